@@ -541,7 +541,11 @@ static WCHAR LfnBuf[FF_MAX_LFN + 1];		/* LFN working buffer */
 #define LEAVE_MKFS(res)	return res
 
 #elif FF_USE_LFN == 3 	/* LFN enabled with dynamic working buffer on the heap */
-#if FF_FS_EXFAT
+#if FF_VOL_WORKBUF		/* Persistent working buffers are attached to the filesystem object */
+#define DEF_NAMBUF
+#define INIT_NAMBUF(fs)
+#define FREE_NAMBUF()
+#elif FF_FS_EXFAT
 #define DEF_NAMBUF		WCHAR *lfn;	/* Pointer to LFN working buffer and directory entry block scratchpad buffer */
 #define INIT_NAMBUF(fs)	{ lfn = ff_memalloc((FF_MAX_LFN+1)*2 + MAXDIRB(FF_MAX_LFN)); if (!lfn) LEAVE_FF(fs, FR_NOT_ENOUGH_CORE); (fs)->lfnbuf = lfn; (fs)->dirbuf = (BYTE*)(lfn+FF_MAX_LFN+1); }
 #define FREE_NAMBUF()	ff_memfree(lfn)
@@ -1102,8 +1106,143 @@ static FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERR */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Move/Flush the FAT and bitmap windows                                 */
+/*-----------------------------------------------------------------------*/
+#if FF_FS_FATWIN
+#if !FF_FS_READONLY
+static FRESULT sync_subwin (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs,		/* Filesystem object */
+	FFWIN* w		/* Window to flush */
+)
+{
+	if (w->flag) {	/* Is the window dirty? */
+		if (disk_write(fs->pdrv, w->buf, w->sect, 1) != RES_OK) return FR_DISK_ERR;
+		w->flag = 0;
+		if (w->sect - fs->fatbase < fs->fsize && fs->n_fats == 2) {	/* Reflect it to 2nd FAT if needed */
+			disk_write(fs->pdrv, w->buf, w->sect + fs->fsize, 1);
+		}
+	}
+	return FR_OK;
+}
+#endif
+
+
+static BYTE* sub_window (	/* Returns the buffer holding the sector, null on disk error */
+	FATFS* fs,		/* Filesystem object */
+	FFWIN* w,		/* Window to move */
+	LBA_t sect		/* Sector LBA to make appearance in the window */
+)
+{
+	if (!w->buf) {	/* No buffer given, use the common window */
+		return (move_window(fs, sect) == FR_OK) ? fs->win : 0;
+	}
+	if (sect != w->sect) {	/* Window offset changed? */
+#if !FF_FS_READONLY
+		if (sync_subwin(fs, w) != FR_OK) return 0;
+#endif
+		if (disk_read(fs->pdrv, w->buf, sect, 1) != RES_OK) {
+			w->sect = (LBA_t)0 - 1;	/* Invalidate window if read data is not valid */
+			return 0;
+		}
+		w->sect = sect;
+	}
+	return w->buf;
+}
+
+
+static void sub_dirty (
+	FATFS* fs,		/* Filesystem object */
+	FFWIN* w		/* Window modified */
+)
+{
+	if (w->buf) {
+		w->flag = 1;
+	} else {
+		fs->wflag = 1;
+	}
+}
+
+#define fat_window(fs, sect)	sub_window(fs, &(fs)->fwin, sect)
+#define bmp_window(fs, sect)	sub_window(fs, &(fs)->bwin, sect)
+#define fat_dirty(fs)			sub_dirty(fs, &(fs)->fwin)
+#define bmp_dirty(fs)			sub_dirty(fs, &(fs)->bwin)
+
+#else
+#define fat_window(fs, sect)	((move_window(fs, sect) == FR_OK) ? (fs)->win : 0)
+#define bmp_window(fs, sect)	fat_window(fs, sect)
+#define fat_dirty(fs)			((fs)->wflag = 1)
+#define bmp_dirty(fs)			((fs)->wflag = 1)
+#endif
+
+
+#if !FF_FS_READONLY
+static FRESULT sync_windows (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs		/* Filesystem object */
+)
+{
+	FRESULT res;
+
+
+	res = sync_window(fs);
+#if FF_FS_FATWIN
+	if (res == FR_OK) res = sync_subwin(fs, &fs->fwin);
+	if (res == FR_OK) res = sync_subwin(fs, &fs->bwin);
+#endif
+	return res;
+}
+#endif
+
+
+
 
 #if !FF_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* Write the allocation information, FSInfo or exFAT PercInUse           */
+/*-----------------------------------------------------------------------*/
+
+static void put_fsinfo (
+	FATFS* fs,		/* Filesystem object */
+	int known		/* 0:Mark the free cluster count unknown */
+)
+{
+	BYTE *buf = fs->win;
+	LBA_t *bsect = &fs->winsect;
+#if FF_FS_LAZY_FSINFO
+	LBA_t isect;
+
+	if (fs->ibuf) {		/* Leave the window as it is */
+		buf = fs->ibuf;
+		bsect = &isect;
+	}
+#endif
+
+	if (fs->fs_type == FS_FAT32) {	/* FAT32: Update FSInfo sector */
+		/* Create FSInfo structure */
+		memset(buf, 0, SS(fs));
+		st_dword(buf + FSI_LeadSig, 0x41615252);		/* Leading signature */
+		st_dword(buf + FSI_StrucSig, 0x61417272);		/* Structure signature */
+		st_dword(buf + FSI_Free_Count, known ? fs->free_clst : 0xFFFFFFFF);	/* Number of free clusters */
+		st_dword(buf + FSI_Nxt_Free, fs->last_clst);	/* Last allocated culuster */
+		st_dword(buf + FSI_TrailSig, 0xAA550000);		/* Trailing signature */
+		disk_write(fs->pdrv, buf, *bsect = fs->volbase + 1, 1);	/* Write it into the FSInfo sector (Next to VBR) */
+	}
+#if FF_FS_EXFAT
+	else if (fs->fs_type == FS_EXFAT) {	/* exFAT: Update PercInUse field in BPB */
+		if (disk_read(fs->pdrv, buf, *bsect = fs->volbase, 1) == RES_OK) {	/* Load VBR */
+			BYTE perc_inuse = (known && fs->free_clst <= fs->n_fatent - 2) ? (BYTE)((QWORD)(fs->n_fatent - 2 - fs->free_clst) * 100 / (fs->n_fatent - 2)) : 0xFF;	/* Precent in use 0-100 or 0xFF(unknown) */
+
+			if (buf[BPB_PercInUseEx] != perc_inuse) {	/* Write it back into VBR if needed */
+				buf[BPB_PercInUseEx] = perc_inuse;
+				disk_write(fs->pdrv, buf, *bsect, 1);
+			}
+		}
+	}
+#endif
+}
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Synchronize filesystem and data on the storage                        */
 /*-----------------------------------------------------------------------*/
@@ -1115,40 +1254,65 @@ static FRESULT sync_fs (	/* Returns FR_OK or FR_DISK_ERR */
 	FRESULT res;
 
 
-	res = sync_window(fs);
+	res = sync_windows(fs);
 	if (res == FR_OK) {
+#if FF_FS_LAZY_FSINFO
+		if ((fs->fsi_flag & 0x83) == 1) {	/* Allocation changed since the last f_syncfs()? */
+			fs->fsi_flag |= 2;
+			put_fsinfo(fs, 0);	/* Mark the information unknown until f_syncfs() */
+		}
+#else
 		if (fs->fsi_flag == 1) {	/* Allocation changed? */
 			fs->fsi_flag = 0;
-			if (fs->fs_type == FS_FAT32) {	/* FAT32: Update FSInfo sector */
-				/* Create FSInfo structure */
-				memset(fs->win, 0, FF_MAX_SS);
-				st_dword(fs->win + FSI_LeadSig, 0x41615252);		/* Leading signature */
-				st_dword(fs->win + FSI_StrucSig, 0x61417272);		/* Structure signature */
-				st_dword(fs->win + FSI_Free_Count, fs->free_clst);	/* Number of free clusters */
-				st_dword(fs->win + FSI_Nxt_Free, fs->last_clst);	/* Last allocated culuster */
-				st_dword(fs->win + FSI_TrailSig, 0xAA550000);		/* Trailing signature */
-				disk_write(fs->pdrv, fs->win, fs->winsect = fs->volbase + 1, 1);	/* Write it into the FSInfo sector (Next to VBR) */
-			}
-#if FF_FS_EXFAT
-			else if (fs->fs_type == FS_EXFAT) {	/* exFAT: Update PercInUse field in BPB */
-				if (disk_read(fs->pdrv, fs->win, fs->winsect = fs->volbase, 1) == RES_OK) {	/* Load VBR */
-					BYTE perc_inuse = (fs->free_clst <= fs->n_fatent - 2) ? (BYTE)((QWORD)(fs->n_fatent - 2 - fs->free_clst) * 100 / (fs->n_fatent - 2)) : 0xFF;	/* Precent in use 0-100 or 0xFF(unknown) */
-
-					if (fs->win[BPB_PercInUseEx] != perc_inuse) {	/* Write it back into VBR if needed */
-						fs->win[BPB_PercInUseEx] = perc_inuse;
-						disk_write(fs->pdrv, fs->win, fs->winsect, 1);
-					}
-				}
-			}
-#endif
+			put_fsinfo(fs, 1);
 		}
+#endif
 		/* Make sure that no pending write process in the lower layer */
 		if (disk_ioctl(fs->pdrv, CTRL_SYNC, 0) != RES_OK) res = FR_DISK_ERR;
+#if FF_FS_SYNC_GROUP
+		if (res == FR_OK) fs->nsync = 0;	/* Waiting file syncs are on the medium */
+#endif
 	}
 
 	return res;
 }
 
+
+
+#if FF_FS_SYNC_GROUP
+/*-----------------------------------------------------------------------*/
+/* Group commit of file syncs                                            */
+/*-----------------------------------------------------------------------*/
+
+static int sync_expired (	/* 1:The oldest waiting file sync is FF_FS_SYNC_TIME old */
+	FATFS* fs,		/* Filesystem object */
+	DWORD tm		/* Current timestamp */
+)
+{
+	int dt;
+
+
+	if ((tm >> 16) != (fs->sync_tm >> 16)) return 1;	/* Date changed */
+	dt = (int)((tm >> 11 & 31) * 3600 + (tm >> 5 & 63) * 60 + (tm & 31) * 2)
+		- (int)((fs->sync_tm >> 11 & 31) * 3600 + (fs->sync_tm >> 5 & 63) * 60 + (fs->sync_tm & 31) * 2);
+	return dt < 0 || dt >= FF_FS_SYNC_TIME;		/* Clock set back or time is up */
+}
+
+
+static FRESULT sync_group (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs,		/* Filesystem object */
+	DWORD tm		/* Timestamp of the file sync */
+)
+{
+	if (fs->nsync == 0) fs->sync_tm = tm;
+	if (++fs->nsync < FF_FS_SYNC_GROUP && !sync_expired(fs, tm)) return FR_OK;	/* Leave the flush to a later file sync */
+	return sync_fs(fs);
+}
+
+#else
+#define sync_group(fs, tm) sync_fs(fs)
+#endif
+
 #endif
 
 
@@ -1182,6 +1346,7 @@ static DWORD get_fat (		/* 0xFFFFFFFF:Disk error, 1:Internal error, 2..0x7FFFFFF
 	UINT wc, bc;
 	DWORD val;
 	FATFS *fs = obj->fs;
+	BYTE *win;
 
 
 	if (clst < 2 || clst >= fs->n_fatent) {	/* Check if in valid range */
@@ -1193,21 +1358,21 @@ static DWORD get_fat (		/* 0xFFFFFFFF:Disk error, 1:Internal error, 2..0x7FFFFFF
 		switch (fs->fs_type) {
 		case FS_FAT12 :
 			bc = (UINT)clst; bc += bc / 2;
-			if (move_window(fs, fs->fatbase + (bc / SS(fs))) != FR_OK) break;
-			wc = fs->win[bc++ % SS(fs)];		/* Get 1st byte of the entry */
-			if (move_window(fs, fs->fatbase + (bc / SS(fs))) != FR_OK) break;
-			wc |= fs->win[bc % SS(fs)] << 8;	/* Merge 2nd byte of the entry */
+			if ((win = fat_window(fs, fs->fatbase + (bc / SS(fs)))) == 0) break;
+			wc = win[bc++ % SS(fs)];		/* Get 1st byte of the entry */
+			if ((win = fat_window(fs, fs->fatbase + (bc / SS(fs)))) == 0) break;
+			wc |= win[bc % SS(fs)] << 8;	/* Merge 2nd byte of the entry */
 			val = (clst & 1) ? (wc >> 4) : (wc & 0xFFF);	/* Adjust bit position */
 			break;
 
 		case FS_FAT16 :
-			if (move_window(fs, fs->fatbase + (clst / (SS(fs) / 2))) != FR_OK) break;
-			val = ld_word(fs->win + clst * 2 % SS(fs));		/* Simple WORD array */
+			if ((win = fat_window(fs, fs->fatbase + (clst / (SS(fs) / 2)))) == 0) break;
+			val = ld_word(win + clst * 2 % SS(fs));		/* Simple WORD array */
 			break;
 
 		case FS_FAT32 :
-			if (move_window(fs, fs->fatbase + (clst / (SS(fs) / 4))) != FR_OK) break;
-			val = ld_dword(fs->win + clst * 4 % SS(fs)) & 0x0FFFFFFF;	/* Simple DWORD array but mask out upper 4 bits */
+			if ((win = fat_window(fs, fs->fatbase + (clst / (SS(fs) / 4)))) == 0) break;
+			val = ld_dword(win + clst * 4 % SS(fs)) & 0x0FFFFFFF;	/* Simple DWORD array but mask out upper 4 bits */
 			break;
 #if FF_FS_EXFAT
 		case FS_EXFAT :
@@ -1227,8 +1392,8 @@ static DWORD get_fat (		/* 0xFFFFFFFF:Disk error, 1:Internal error, 2..0x7FFFFFF
 					if (obj->n_frag != 0) {	/* Is it on the growing edge? */
 						val = 0x7FFFFFFF;	/* Generate EOC */
 					} else {
-						if (move_window(fs, fs->fatbase + (clst / (SS(fs) / 4))) != FR_OK) break;
-						val = ld_dword(fs->win + clst * 4 % SS(fs)) & 0x7FFFFFFF;
+						if ((win = fat_window(fs, fs->fatbase + (clst / (SS(fs) / 4)))) == 0) break;
+						val = ld_dword(win + clst * 4 % SS(fs)) & 0x7FFFFFFF;
 					}
 					break;
 				}
@@ -1259,7 +1424,7 @@ static FRESULT put_fat (	/* FR_OK(0):succeeded, !=0:error */
 )
 {
 	UINT bc;
-	BYTE *p;
+	BYTE *p, *win;
 	FRESULT res = FR_INT_ERR;
 
 
@@ -1267,36 +1432,38 @@ static FRESULT put_fat (	/* FR_OK(0):succeeded, !=0:error */
 		switch (fs->fs_type) {
 		case FS_FAT12:
 			bc = (UINT)clst; bc += bc / 2;	/* bc: byte offset of the entry */
-			res = move_window(fs, fs->fatbase + (bc / SS(fs)));
-			if (res != FR_OK) break;
-			p = fs->win + bc++ % SS(fs);
+			res = FR_DISK_ERR;
+			if ((win = fat_window(fs, fs->fatbase + (bc / SS(fs)))) == 0) break;
+			p = win + bc++ % SS(fs);
 			*p = (clst & 1) ? ((*p & 0x0F) | ((BYTE)val << 4)) : (BYTE)val;	/* Update 1st byte */
-			fs->wflag = 1;
-			res = move_window(fs, fs->fatbase + (bc / SS(fs)));
-			if (res != FR_OK) break;
-			p = fs->win + bc % SS(fs);
+			fat_dirty(fs);
+			if ((win = fat_window(fs, fs->fatbase + (bc / SS(fs)))) == 0) break;
+			p = win + bc % SS(fs);
 			*p = (clst & 1) ? (BYTE)(val >> 4) : ((*p & 0xF0) | ((BYTE)(val >> 8) & 0x0F));	/* Update 2nd byte */
-			fs->wflag = 1;
+			fat_dirty(fs);
+			res = FR_OK;
 			break;
 
 		case FS_FAT16:
-			res = move_window(fs, fs->fatbase + (clst / (SS(fs) / 2)));
-			if (res != FR_OK) break;
-			st_word(fs->win + clst * 2 % SS(fs), (WORD)val);	/* Simple WORD array */
-			fs->wflag = 1;
+			res = FR_DISK_ERR;
+			if ((win = fat_window(fs, fs->fatbase + (clst / (SS(fs) / 2)))) == 0) break;
+			st_word(win + clst * 2 % SS(fs), (WORD)val);	/* Simple WORD array */
+			fat_dirty(fs);
+			res = FR_OK;
 			break;
 
 		case FS_FAT32:
 #if FF_FS_EXFAT
 		case FS_EXFAT:
 #endif
-			res = move_window(fs, fs->fatbase + (clst / (SS(fs) / 4)));
-			if (res != FR_OK) break;
+			res = FR_DISK_ERR;
+			if ((win = fat_window(fs, fs->fatbase + (clst / (SS(fs) / 4)))) == 0) break;
 			if (!FF_FS_EXFAT || fs->fs_type != FS_EXFAT) {
-				val = (val & 0x0FFFFFFF) | (ld_dword(fs->win + clst * 4 % SS(fs)) & 0xF0000000);
+				val = (val & 0x0FFFFFFF) | (ld_dword(win + clst * 4 % SS(fs)) & 0xF0000000);
 			}
-			st_dword(fs->win + clst * 4 % SS(fs), val);
-			fs->wflag = 1;
+			st_dword(win + clst * 4 % SS(fs), val);
+			fat_dirty(fs);
+			res = FR_OK;
 			break;
 		}
 	}
@@ -1323,7 +1490,7 @@ static DWORD find_bitmap (	/* 0:Not found, 2..:Cluster block found, 0xFFFFFFFF:D
 	DWORD ncl	/* Number of contiguous clusters to find (1..) */
 )
 {
-	BYTE bm, bv;
+	BYTE bm, bv, *win;
 	UINT i;
 	DWORD val, scl, ctr;
 
@@ -1332,11 +1499,11 @@ static DWORD find_bitmap (	/* 0:Not found, 2..:Cluster block found, 0xFFFFFFFF:D
 	if (clst >= fs->n_fatent - 2) clst = 0;
 	scl = val = clst; ctr = 0;
 	for (;;) {
-		if (move_window(fs, fs->bitbase + val / 8 / SS(fs)) != FR_OK) return 0xFFFFFFFF;
+		if ((win = bmp_window(fs, fs->bitbase + val / 8 / SS(fs))) == 0) return 0xFFFFFFFF;
 		i = val / 8 % SS(fs); bm = 1 << (val % 8);
 		do {
 			do {
-				bv = fs->win[i] & bm; bm <<= 1;		/* Get bit value */
+				bv = win[i] & bm; bm <<= 1;		/* Get bit value */
 				if (++val >= fs->n_fatent - 2) {	/* Next cluster (with wrap-around) */
 					val = 0; bm = 0; i = SS(fs);
 				}
@@ -1364,7 +1531,7 @@ static FRESULT change_bitmap (
 	int bv		/* bit value to be set (0 or 1) */
 )
 {
-	BYTE bm;
+	BYTE bm, *win;
 	UINT i;
 	LBA_t sect;
 
@@ -1374,12 +1541,12 @@ static FRESULT change_bitmap (
 	i = clst / 8 % SS(fs);					/* Byte offset in the sector */
 	bm = 1 << (clst % 8);					/* Bit mask in the byte */
 	for (;;) {
-		if (move_window(fs, sect++) != FR_OK) return FR_DISK_ERR;
+		if ((win = bmp_window(fs, sect++)) == 0) return FR_DISK_ERR;
 		do {
 			do {
-				if (bv == (int)((fs->win[i] & bm) != 0)) return FR_INT_ERR;	/* Is the bit expected value? */
-				fs->win[i] ^= bm;	/* Flip the bit */
-				fs->wflag = 1;
+				if (bv == (int)((win[i] & bm) != 0)) return FR_INT_ERR;	/* Is the bit expected value? */
+				win[i] ^= bm;	/* Flip the bit */
+				bmp_dirty(fs);
 				if (--ncl == 0) return FR_OK;	/* All bits processed? */
 			} while (bm <<= 1);		/* Next bit */
 			bm = 1;
@@ -1466,6 +1633,10 @@ static FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 		if (res != FR_OK) return res;
 	}
 
+#if FF_FS_AU_SIZE
+	fs->au_full = 0;	/* Released clusters may complete a free AU */
+#endif
+
 	/* Remove the chain */
 	do {
 		nxt = get_fat(obj, clst);			/* Get cluster status */
@@ -1533,6 +1704,181 @@ static FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 
 
 
+#if FF_FS_RESERVE
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Cluster reservations of the files being written        */
+/*-----------------------------------------------------------------------*/
+
+static FFRSV* rsv_slot (	/* Pointer to the reservation of the object (null:no reservation) */
+	FFOBJID* obj,		/* Corresponding object */
+	int create			/* Take a slot if the object has none */
+)
+{
+	FATFS *fs = obj->fs;
+	FFRSV *rsv = 0;
+	UINT i;
+
+
+	for (i = 0; i < FF_FS_RESERVE_FILES; i++) {
+		if (fs->rsv[i].obj == obj) return &fs->rsv[i];
+		if (!rsv || (rsv->obj && (!fs->rsv[i].obj || fs->rsv[i].use < rsv->use))) rsv = &fs->rsv[i];	/* Free or least recent slot */
+	}
+	if (!create || fs->rsv_clst == 0) return 0;
+	rsv->obj = obj;
+	rsv->scl = rsv->ecl = 0;		/* Nothing reserved until the first allocation */
+	rsv->use = ++fs->rsv_use;
+	return rsv;
+}
+
+
+static DWORD rsv_check (	/* 0:Not reserved for another object, >=2:Cluster# following the reservation */
+	FFOBJID* obj,		/* Object allocating the cluster */
+	DWORD clst			/* Cluster# to check */
+)
+{
+	FATFS *fs = obj->fs;
+	UINT i;
+
+
+	for (i = 0; i < FF_FS_RESERVE_FILES; i++) {
+		if (fs->rsv[i].obj && fs->rsv[i].obj != obj && clst >= fs->rsv[i].scl && clst < fs->rsv[i].ecl) return fs->rsv[i].ecl;
+	}
+	return 0;
+}
+
+
+static void rsv_update (
+	FFOBJID* obj,		/* Object a cluster was allocated to */
+	DWORD clst			/* The allocated cluster */
+)
+{
+	FATFS *fs = obj->fs;
+	FFRSV *rsv = rsv_slot(obj, 0);
+
+
+	if (!rsv) return;					/* Not a file being written */
+	if (clst < rsv->scl || clst >= rsv->ecl) {	/* Out of the reservation? */
+		rsv->ecl = (fs->n_fatent - clst - 1 > fs->rsv_clst) ? clst + 1 + fs->rsv_clst : fs->n_fatent;	/* Reserve ahead of the new cluster */
+	}
+	rsv->scl = clst + 1;				/* The reservation follows the file */
+	rsv->use = ++fs->rsv_use;
+}
+
+
+static void rsv_release (
+	FFOBJID* obj		/* Object to return the reservation of */
+)
+{
+	FFRSV *rsv = rsv_slot(obj, 0);
+
+
+	if (rsv) rsv->obj = 0;
+}
+#endif	/* FF_FS_RESERVE */
+
+
+
+
+#if FF_FS_AU_SIZE
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Allocation aligned to the AU of flash media            */
+/*-----------------------------------------------------------------------*/
+
+static void init_au (
+	FATFS* fs		/* Filesystem object */
+)
+{
+	DWORD au;
+
+
+	au = FF_FS_AU_SIZE / SS(fs);	/* AU size [sectors] */
+	while (au > fs->csize && (fs->database & (au - 1)) != 0) au >>= 1;	/* Largest AU the data area is aligned to */
+	fs->au_clst = (au > fs->csize) ? au / fs->csize : 0;
+	fs->au_full = 0;
+}
+
+
+static DWORD au_stat (	/* 0:Free, 2:In use, 1:Internal error, 0xFFFFFFFF:Disk error */
+	FFOBJID* obj,		/* Corresponding object */
+	DWORD clst			/* Cluster# to check */
+)
+{
+	FATFS *fs = obj->fs;
+	DWORD cs;
+#if FF_FS_EXFAT
+	BYTE *win;
+
+
+	if (fs->fs_type == FS_EXFAT) {	/* The allocation bitmap tells it on the exFAT volume */
+		if ((win = bmp_window(fs, fs->bitbase + (clst - 2) / 8 / SS(fs))) == 0) return 0xFFFFFFFF;
+		cs = (win[(clst - 2) / 8 % SS(fs)] & (1 << ((clst - 2) % 8))) ? 2 : 0;
+	} else
+#endif
+	{
+		cs = get_fat(obj, clst);
+	}
+#if FF_FS_RESERVE
+	if (cs == 0 && rsv_check(obj, clst)) return 2;	/* Reserved for another file */
+#endif
+	return (cs >= 2 && cs != 0xFFFFFFFF) ? 2 : cs;
+}
+
+
+static DWORD find_au_block (	/* 0:Not found, 1:Internal error, 0xFFFFFFFF:Disk error, >=2:First cluster of the block */
+	FFOBJID* obj,		/* Corresponding object */
+	DWORD clst,			/* Cluster# to search after */
+	DWORD ncl			/* Number of free clusters needed from the AU boundary on */
+)
+{
+	FATFS *fs = obj->fs;
+	DWORD n_au, au, n, i, scl, cs;
+
+
+	n_au = (fs->n_fatent - 2) / fs->au_clst;	/* Number of AUs on the volume */
+	au = (clst >= 2 && clst < fs->n_fatent) ? (clst - 2) / fs->au_clst + 1 : 0;	/* Start at the AU following clst */
+	if (au >= n_au) au = 0;
+	for (n = 0; n < n_au; n++) {
+		scl = 2 + au * fs->au_clst;
+		if (ncl <= fs->n_fatent - scl) {	/* Does the block fit in the volume? */
+			for (i = 0; i < ncl; i++) {
+				cs = au_stat(obj, scl + i);
+				if (cs == 1 || cs == 0xFFFFFFFF) return cs;
+				if (cs != 0) break;
+			}
+			if (i == ncl) return scl;		/* Found */
+			n += i / fs->au_clst;			/* Blocks starting up to the AU of the cluster in use include it as well */
+			au += i / fs->au_clst;
+		}
+		if (++au >= n_au) au -= n_au;
+	}
+	return 0;
+}
+
+
+static DWORD au_next (	/* 0:Use the common allocation, 1:Internal error, 0xFFFFFFFF:Disk error, >=2:Cluster# to allocate */
+	FFOBJID* obj,		/* Corresponding object */
+	DWORD clst			/* Last cluster of the large file to stretch */
+)
+{
+	FATFS *fs = obj->fs;
+	DWORD ncl, cs;
+
+
+	ncl = clst + 1;
+	if (ncl < fs->n_fatent && (ncl - 2) % fs->au_clst != 0) {	/* Is the next cluster in the same AU? */
+		cs = au_stat(obj, ncl);
+		if (cs != 2) return cs ? cs : ncl;		/* Take it if it is free */
+	}
+	if (fs->au_full) return 0;					/* No free AU left? */
+	ncl = find_au_block(obj, clst, fs->au_clst);	/* Continue in an entirely free AU */
+	if (ncl == 0) fs->au_full = 1;				/* Leave it to the common allocation until clusters get released */
+	return ncl;
+}
+#endif	/* FF_FS_AU_SIZE */
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* FAT handling - Stretch a chain or Create a new chain                  */
 /*-----------------------------------------------------------------------*/
@@ -1545,6 +1891,15 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 	DWORD cs, ncl, scl;
 	FRESULT res;
 	FATFS *fs = obj->fs;
+#if FF_FS_AU_SIZE
+	DWORD acl = 0;
+#endif
+#if FF_FS_RESERVE
+	DWORD rcl = 0;
+#if FF_FS_EXFAT
+	UINT n;
+#endif
+#endif
 
 
 	if (clst == 0) {	/* Create a new chain */
@@ -1559,10 +1914,25 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 		scl = clst;							/* Cluster to start to find */
 	}
 	if (fs->free_clst == 0) return 0;		/* No free cluster */
+#if FF_FS_AU_SIZE
+	if (clst != 0 && fs->au_clst != 0 && obj->objsize >= (FSIZE_t)fs->au_clst * fs->csize * SS(fs) / 4) {	/* Stretching a large file? */
+		acl = au_next(obj, clst);			/* Find the cluster in its AU or in a free AU */
+		if (acl == 1 || acl == 0xFFFFFFFF) return acl;
+	}
+#endif
 
 #if FF_FS_EXFAT
 	if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
+#if FF_FS_AU_SIZE
+		if (acl != 0) ncl = acl; else
+#endif
 		ncl = find_bitmap(fs, scl, 1);				/* Find a free cluster */
+#if FF_FS_RESERVE
+		for (rcl = ncl, n = 0; ncl >= 2 && ncl != 0xFFFFFFFF && n < FF_FS_RESERVE_FILES && (cs = rsv_check(obj, ncl)) != 0; n++) {	/* Reserved for another file? */
+			ncl = find_bitmap(fs, cs, 1);			/* Find one following the reservation */
+		}
+		if (ncl >= 2 && ncl != 0xFFFFFFFF && rsv_check(obj, ncl)) ncl = rcl;	/* Use a reserved one if there is no other */
+#endif
 		if (ncl == 0 || ncl == 0xFFFFFFFF) return ncl;	/* No free cluster or hard error? */
 		res = change_bitmap(fs, ncl, 1, 1);			/* Mark the cluster 'in use' */
 		if (res == FR_INT_ERR) return 1;
@@ -1588,11 +1958,17 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 #endif
 	{	/* On the FAT/FAT32 volume */
 		ncl = 0;
-		if (scl == clst) {						/* Stretching an existing chain? */
+#if FF_FS_AU_SIZE
+		ncl = acl;								/* Cluster found for a large file */
+#endif
+		if (ncl == 0 && scl == clst) {			/* Stretching an existing chain? */
 			ncl = scl + 1;						/* Test if next cluster is free */
 			if (ncl >= fs->n_fatent) ncl = 2;
 			cs = get_fat(obj, ncl);				/* Get next cluster status */
 			if (cs == 1 || cs == 0xFFFFFFFF) return cs;	/* Test for error */
+#if FF_FS_RESERVE
+			if (cs == 0 && rsv_check(obj, ncl)) cs = 2;	/* Reserved for another file? */
+#endif
 			if (cs != 0) {						/* Not free? */
 				cs = fs->last_clst;				/* Start at suggested cluster if it is valid */
 				if (cs >= 2 && cs < fs->n_fatent) scl = cs;
@@ -1605,13 +1981,23 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 				ncl++;							/* Next cluster */
 				if (ncl >= fs->n_fatent) {		/* Check wrap-around */
 					ncl = 2;
-					if (ncl > scl) return 0;	/* No free cluster found? */
+					if (ncl > scl) { ncl = 0; break; }	/* No free cluster found? */
 				}
 				cs = get_fat(obj, ncl);			/* Get the cluster status */
+#if FF_FS_RESERVE
+				if (cs == 0 && rsv_check(obj, ncl)) {	/* Reserved for another file? */
+					if (rcl == 0) rcl = ncl;	/* Use it only if there is no other free cluster */
+					cs = 2;
+				}
+#endif
 				if (cs == 0) break;				/* Found a free cluster? */
 				if (cs == 1 || cs == 0xFFFFFFFF) return cs;	/* Test for error */
-				if (ncl == scl) return 0;		/* No free cluster found? */
+				if (ncl == scl) { ncl = 0; break; }	/* No free cluster found? */
 			}
+#if FF_FS_RESERVE
+			if (ncl == 0) ncl = rcl;
+#endif
+			if (ncl == 0) return 0;
 		}
 		res = put_fat(fs, ncl, 0xFFFFFFFF);		/* Mark the new cluster 'EOC' */
 		if (res == FR_OK && clst != 0) {
@@ -1620,11 +2006,17 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 	}
 
 	if (res == FR_OK) {			/* Update allocation information if the function succeeded */
+#if FF_FS_AU_SIZE
+		if (acl == 0)			/* Large files do not move the start point of the other files */
+#endif
 		fs->last_clst = ncl;
 		if (fs->free_clst > 0 && fs->free_clst <= fs->n_fatent - 2) {
 			fs->free_clst--;
 			fs->fsi_flag |= 1;
 		}
+#if FF_FS_RESERVE
+		rsv_update(obj, ncl);	/* Move the reservation of a file being written along */
+#endif
 	} else {
 		ncl = (res == FR_DISK_ERR) ? 0xFFFFFFFF : 1;	/* Failed. Generate error status */
 	}
@@ -1673,36 +2065,87 @@ static DWORD clmt_clust (	/* <2:Error, >=2:Cluster number */
 /*-----------------------------------------------------------------------*/
 
 #if !FF_FS_READONLY
-static FRESULT dir_clear (	/* Returns FR_OK or FR_DISK_ERR */
+#if FF_USE_LFN == 3
+static const BYTE* alloc_zbuf (	/* Returns a zero filled buffer for dir_clear_buf (null:not available) */
 	FATFS *fs,		/* Filesystem object */
-	DWORD clst		/* Directory table to clear */
+	UINT *szb		/* Returns size of the buffer [sectors] */
 )
 {
-	LBA_t sect;
-	UINT n, szb;
+	UINT sz;
+#if FF_VOL_WORKBUF
+	sz = fs->csize * SS(fs);	/* Use the buffer attached to the volume, up to a cluster */
+	if (sz > fs->zbsize) sz = fs->zbsize;
+	if (!fs->zbuf || sz <= SS(fs)) return 0;	/* Not worth over the window buffer */
+	*szb = sz / SS(fs);
+	return fs->zbuf;
+#else
 	BYTE *ibuf;
 
 
+	for (sz = ((DWORD)fs->csize * SS(fs) >= MAX_MALLOC) ? MAX_MALLOC : fs->csize * SS(fs), ibuf = 0; sz > SS(fs) && (ibuf = ff_memalloc(sz)) == 0; sz /= 2) ;
+	if (sz <= SS(fs)) return 0;	/* Not worth over the window buffer */
+	memset(ibuf, 0, sz);
+	*szb = sz / SS(fs);		/* Bytes -> Sectors */
+	return ibuf;
+#endif
+}
+
+
+static void free_zbuf (
+	const BYTE *ibuf	/* Buffer returned by alloc_zbuf */
+)
+{
+#if !FF_VOL_WORKBUF
+	if (ibuf) ff_memfree((void*)ibuf);
+#else
+	(void)ibuf;		/* Owned by the volume */
+#endif
+}
+#endif
+
+
+static FRESULT dir_clear_buf (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS *fs,		/* Filesystem object */
+	DWORD clst,		/* Directory table to clear */
+	const BYTE *ibuf,	/* Zero filled buffer (null:use the window) */
+	UINT szb		/* Size of the zero filled buffer [sectors] */
+)
+{
+	LBA_t sect;
+	UINT n;
+
+
 	if (sync_window(fs) != FR_OK) return FR_DISK_ERR;	/* Flush disk access window */
 	sect = clst2sect(fs, clst);		/* Top of the cluster */
 	fs->winsect = sect;				/* Set window to top of the cluster */
-	memset(fs->win, 0, FF_MAX_SS);	/* Clear window buffer */
-#if FF_USE_LFN == 3		/* Quick table clear by using multi-secter write */
-	/* Allocate a temporary buffer */
-	for (szb = ((DWORD)fs->csize * SS(fs) >= MAX_MALLOC) ? MAX_MALLOC : fs->csize * SS(fs), ibuf = 0; szb > SS(fs) && (ibuf = ff_memalloc(szb)) == 0; szb /= 2) ;
-	if (szb > SS(fs)) {		/* Buffer allocated? */
-		memset(ibuf, 0, szb);
-		szb /= SS(fs);		/* Bytes -> Sectors */
-		for (n = 0; n < fs->csize && disk_write(fs->pdrv, ibuf, sect + n, szb) == RES_OK; n += szb) ;	/* Fill the cluster with 0 */
-		ff_memfree(ibuf);
-	} else
-#endif
-	{
+	memset(fs->win, 0, SS(fs));	/* Clear window buffer */
+	if (!ibuf) {
 		ibuf = fs->win; szb = 1;	/* Use window buffer (many single-sector writes may take a time) */
-		for (n = 0; n < fs->csize && disk_write(fs->pdrv, ibuf, sect + n, szb) == RES_OK; n += szb) ;	/* Fill the cluster with 0 */
 	}
+	for (n = 0; n < fs->csize && disk_write(fs->pdrv, ibuf, sect + n, szb) == RES_OK; n += szb) ;	/* Fill the cluster with 0 */
 	return (n == fs->csize) ? FR_OK : FR_DISK_ERR;
 }
+
+
+static FRESULT dir_clear (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS *fs,		/* Filesystem object */
+	DWORD clst		/* Directory table to clear */
+)
+{
+	FRESULT res;
+	UINT szb = 1;
+	const BYTE *ibuf = 0;
+
+
+#if FF_USE_LFN == 3		/* Quick table clear by using multi-secter write */
+	ibuf = alloc_zbuf(fs, &szb);	/* Allocate a temporary buffer */
+#endif
+	res = dir_clear_buf(fs, clst, ibuf, szb);
+#if FF_USE_LFN == 3
+	free_zbuf(ibuf);
+#endif
+	return res;
+}
 #endif	/* !FF_FS_READONLY */
 
 
@@ -1725,6 +2168,10 @@ static FRESULT dir_sdi (	/* FR_OK(0):succeeded, !=0:error */
 		return FR_INT_ERR;
 	}
 	dp->dptr = ofs;				/* Set current offset */
+#if !FF_FS_READONLY
+	dp->alloc_ofs = 0xFFFFFFFF;	/* Restart free block tracking */
+	dp->free_n = 0;
+#endif
 	clst = dp->obj.sclust;		/* Table start cluster (0:root) */
 	if (clst == 0 && fs->fs_type >= FS_FAT32) {	/* Replace cluster# 0 with root cluster# */
 		clst = (DWORD)fs->dirbase;
@@ -1817,6 +2264,57 @@ static FRESULT dir_next (	/* FR_OK(0):succeeded, FR_NO_FILE:End of table, FR_DEN
 
 
 #if !FF_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Track free entries for dir_alloc while scanning  */
+/*-----------------------------------------------------------------------*/
+
+static UINT dir_nent (	/* Number of entries dir_register() needs for the object name */
+	DIR* dp				/* Pointer to the directory object with the object name */
+)
+{
+#if FF_USE_LFN
+	FATFS *fs = dp->obj.fs;
+	UINT len;
+
+
+	for (len = 0; fs->lfnbuf[len]; len++) ;	/* Get lfn length */
+#if FF_FS_EXFAT
+	if (fs->fs_type == FS_EXFAT) return (len + 14) / 15 + 2;	/* 85+C0+C1s */
+#endif
+	return (dp->fn[NSFLAG] & NS_LFN) ? (len + 12) / 13 + 1 : 1;	/* LFNs+SFN */
+#else
+	return 1;
+#endif
+}
+
+
+static void track_free (
+	DIR* dp,			/* Pointer to the directory object being scanned */
+	int free			/* The entry at dp->dptr is 1:free or 0:in use */
+)
+{
+	if (dp->alloc_ofs != 0xFFFFFFFF) return;	/* First fit has been found */
+	if (!free) {
+		dp->free_n = 0;
+	} else {
+		if (dp->free_n++ == 0) dp->free_ofs = dp->dptr;
+		if (dp->free_n >= dp->alloc_n) dp->alloc_ofs = dp->free_ofs;
+	}
+}
+
+
+static void track_end (
+	DIR* dp				/* Pointer to the directory object which reached end of table marker */
+)
+{
+	if (dp->alloc_ofs == 0xFFFFFFFF) {	/* The rest of the table is free */
+		dp->alloc_ofs = dp->free_n ? dp->free_ofs : dp->dptr;
+	}
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Directory handling - Reserve a block of directory entries             */
 /*-----------------------------------------------------------------------*/
@@ -1828,10 +2326,14 @@ static FRESULT dir_alloc (	/* FR_OK(0):succeeded, !=0:error */
 {
 	FRESULT res;
 	UINT n;
+	DWORD ofs = 0;
 	FATFS *fs = dp->obj.fs;
 
 
-	res = dir_sdi(dp, 0);
+	if (dp->alloc_ofs != 0xFFFFFFFF && dp->alloc_n == n_ent) {	/* Has the last scan found the first fit? */
+		ofs = dp->alloc_ofs;	/* No free block large enough in front of it */
+	}
+	res = dir_sdi(dp, ofs);
 	if (res == FR_OK) {
 		n = 0;
 		do {
@@ -2011,34 +2513,59 @@ static void put_lfn (
 /* FAT-LFN: Create a Numbered SFN                                        */
 /*-----------------------------------------------------------------------*/
 
+#define N_NUMTAIL	99	/* Number of numeric tails to try before giving up */
+
+static void gen_numtails (
+	WORD* tail,			/* Array to store the numeric tails for sequence number 1..N_NUMTAIL */
+	const WCHAR* lfn	/* Pointer to LFN */
+)
+{
+	UINT i, seq;
+	WCHAR wc;
+	DWORD crc_sreg, xn, m, h;
+
+
+	/* The hashed tail is a CRC of the LFN seeded with the sequence number. The CRC is
+	   linear, so it equals the CRC seeded with 0 xor the seed times x^(16*len) mod the
+	   polynomial, and one pass over the LFN serves every sequence number. */
+	crc_sreg = 0; xn = 1;
+	while (*lfn) {
+		wc = *lfn++;
+		for (i = 0; i < 16; i++) {
+			crc_sreg = (crc_sreg << 1) + (wc & 1);
+			wc >>= 1;
+			if (crc_sreg & 0x10000) crc_sreg ^= 0x11021;
+			xn <<= 1;
+			if (xn & 0x10000) xn ^= 0x11021;
+		}
+	}
+	for (seq = 1; seq <= N_NUMTAIL; seq++) {
+		if (!FF_SFN_HASH && seq <= 5) {	/* Sequential number for the first few collisions */
+			tail[seq - 1] = (WORD)seq;
+			continue;
+		}
+		for (h = crc_sreg, m = xn, i = seq; i; i >>= 1) {	/* Hash number instead of sequential number */
+			if (i & 1) h ^= m;
+			m <<= 1;
+			if (m & 0x10000) m ^= 0x11021;
+		}
+		tail[seq - 1] = (WORD)h;
+	}
+}
+
+
 static void gen_numname (
 	BYTE* dst,			/* Pointer to the buffer to store numbered SFN */
 	const BYTE* src,	/* Pointer to SFN in directory form */
-	const WCHAR* lfn,	/* Pointer to LFN */
-	UINT seq			/* Sequence number */
+	UINT seq			/* Numeric tail */
 )
 {
 	BYTE ns[8], c;
 	UINT i, j;
-	WCHAR wc;
-	DWORD crc_sreg;
 
 
 	memcpy(dst, src, 11);	/* Prepare the SFN to be modified */
 
-	if (seq > 5) {	/* In case of many collisions, generate a hash number instead of sequential number */
-		crc_sreg = seq;
-		while (*lfn) {	/* Create a CRC value as a hash of LFN */
-			wc = *lfn++;
-			for (i = 0; i < 16; i++) {
-				crc_sreg = (crc_sreg << 1) + (wc & 1);
-				wc >>= 1;
-				if (crc_sreg & 0x10000) crc_sreg ^= 0x11021;
-			}
-		}
-		seq = (UINT)crc_sreg;
-	}
-
 	/* Make suffix (~ + hexdecimal) */
 	i = 7;
 	do {
@@ -2341,10 +2868,16 @@ static FRESULT dir_read (
 		if (res != FR_OK) break;
 		b = dp->dir[DIR_Name];	/* Test for the entry type */
 		if (b == 0) {
+#if !FF_FS_READONLY
+			track_end(dp);
+#endif
 			res = FR_NO_FILE; break; /* Reached to end of the directory */
 		}
 #if FF_FS_EXFAT
 		if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
+#if !FF_FS_READONLY
+			track_free(dp, !(b & 0x80));	/* File entry blocks loaded below are in use as a whole */
+#endif
 			if (FF_USE_LABEL && vol) {
 				if (b == ET_VLABEL) break;	/* Volume label entry? */
 			} else {
@@ -2415,6 +2948,9 @@ static FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 
 	res = dir_sdi(dp, 0);			/* Rewind directory object */
 	if (res != FR_OK) return res;
+#if !FF_FS_READONLY
+	dp->alloc_n = (WORD)dir_nent(dp);	/* Find the free block to register the name at on the way */
+#endif
 #if FF_FS_EXFAT
 	if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
 		BYTE nc;
@@ -2443,7 +2979,15 @@ static FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 		res = move_window(fs, dp->sect);
 		if (res != FR_OK) break;
 		c = dp->dir[DIR_Name];
-		if (c == 0) { res = FR_NO_FILE; break; }	/* Reached end of directory table */
+		if (c == 0) {	/* Reached end of directory table */
+#if !FF_FS_READONLY
+			track_end(dp);
+#endif
+			res = FR_NO_FILE; break;
+		}
+#if !FF_FS_READONLY
+		track_free(dp, c == DDEM);
+#endif
 #if FF_USE_LFN		/* LFN configuration */
 		dp->obj.attr = a = dp->dir[DIR_Attr] & AM_MASK;
 		if (c == DDEM || ((a & AM_VOL) && a != AM_LFN)) {	/* An entry without valid data */
@@ -2479,6 +3023,79 @@ static FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 
 
 
+#if FF_USE_LFN && !FF_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* FAT-LFN: Find a free numbered SFN in a single directory scan          */
+/*-----------------------------------------------------------------------*/
+
+static FRESULT find_numname (	/* FR_OK:free SFN set to dp->fn, FR_DENIED:too many SFN collision, FR_DISK_ERR:disk error */
+	DIR* dp,					/* Target directory */
+	const BYTE* sn				/* SFN in directory form to be numbered */
+)
+{
+	FRESULT res;
+	FATFS *fs = dp->obj.fs;
+	WORD tail[N_NUMTAIL];
+	DWORD used[(N_NUMTAIL + 31) / 32];
+	BYTE tpos[5], c;
+	UINT d, k, n, v;
+
+
+	for (d = 1; d <= 4; d++) {	/* Position of the '~' for each width of the tail */
+		gen_numname(dp->fn, sn, 1 << (4 * (d - 1)));
+		for (k = 8; k > 0 && dp->fn[k - 1] == ' '; k--) ;
+		tpos[d] = (BYTE)(k - d - 1);
+	}
+	gen_numtails(tail, fs->lfnbuf);
+	memset(used, 0, sizeof used);
+
+	res = dir_sdi(dp, 0);
+	while (res == FR_OK) {		/* Collect the tails in use for this SFN body and extension */
+		res = move_window(fs, dp->sect);
+		if (res != FR_OK) break;
+		c = dp->dir[DIR_Name];
+		if (c == 0) {			/* Reached end of directory table */
+			track_end(dp);
+			break;
+		}
+		track_free(dp, c == DDEM);	/* Keep the free block hint of dir_find() */
+		if (c != DDEM && !(dp->dir[DIR_Attr] & AM_VOL) && !memcmp(dp->dir + 8, sn + 8, 3)) {
+			for (d = 1; d <= 4; d++) {
+				k = tpos[d];
+				if (dp->dir[k] != '~' || memcmp(dp->dir, sn, k)) continue;
+				for (v = 0, n = 0; n < d; n++) {	/* Get hexdecimal tail */
+					c = dp->dir[k + 1 + n];
+					if (IsDigit(c)) {
+						c -= '0';
+					} else if (c >= 'A' && c <= 'F') {
+						c -= 'A' - 10;
+					} else {
+						break;
+					}
+					v = v << 4 | c;
+				}
+				if (n < d || (d > 1 && v < 1U << (4 * (d - 1)))) continue;	/* Wrong width or leading zero */
+				for (n = k + 1 + d; n < 8 && dp->dir[n] == ' '; n++) ;
+				if (n < 8) continue;
+				for (n = 0; n < N_NUMTAIL; n++) {
+					if (tail[n] == v) used[n / 32] |= 1UL << (n % 32);
+				}
+			}
+		}
+		res = dir_next(dp, 0);
+	}
+	if (res == FR_NO_FILE) res = FR_OK;
+	if (res != FR_OK) return res;
+
+	for (n = 0; n < N_NUMTAIL && (used[n / 32] & 1UL << (n % 32)); n++) ;
+	if (n == N_NUMTAIL) return FR_DENIED;	/* Abort if too many collisions */
+	gen_numname(dp->fn, sn, tail[n]);
+	return FR_OK;
+}
+#endif	/* FF_USE_LFN && !FF_FS_READONLY */
+
+
+
 #if !FF_FS_READONLY
 /*-----------------------------------------------------------------------*/
 /* Register an object to the directory                                   */
@@ -2491,16 +3108,15 @@ static FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too
 	FRESULT res;
 	FATFS *fs = dp->obj.fs;
 #if FF_USE_LFN		/* LFN configuration */
-	UINT n, len, n_ent;
+	UINT n_ent;
 	BYTE sn[12], sum;
 
 
 	if (dp->fn[NSFLAG] & (NS_DOT | NS_NONAME)) return FR_INVALID_NAME;	/* Check name validity */
-	for (len = 0; fs->lfnbuf[len]; len++) ;	/* Get lfn length */
+	n_ent = dir_nent(dp);	/* Number of entries to allocate */
 
 #if FF_FS_EXFAT
 	if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
-		n_ent = (len + 14) / 15 + 2;	/* Number of entries to allocate (85+C0+C1s) */
 		res = dir_alloc(dp, n_ent);		/* Allocate directory entries */
 		if (res != FR_OK) return res;
 		dp->blk_ofs = dp->dptr - SZDIRE * (n_ent - 1);	/* Set the allocated entry block offset */
@@ -2532,19 +3148,12 @@ static FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too
 	/* On the FAT/FAT32 volume */
 	memcpy(sn, dp->fn, 12);
 	if (sn[NSFLAG] & NS_LOSS) {			/* When LFN is out of 8.3 format, generate a numbered name */
-		dp->fn[NSFLAG] = NS_NOLFN;		/* Find only SFN */
-		for (n = 1; n < 100; n++) {
-			gen_numname(dp->fn, sn, fs->lfnbuf, n);	/* Generate a numbered name */
-			res = dir_find(dp);				/* Check if the name collides with existing SFN */
-			if (res != FR_OK) break;
-		}
-		if (n == 100) return FR_DENIED;		/* Abort if too many collisions */
-		if (res != FR_NO_FILE) return res;	/* Abort if the result is other than 'not collided' */
+		res = find_numname(dp, sn);
+		if (res != FR_OK) return res;
 		dp->fn[NSFLAG] = sn[NSFLAG];
 	}
 
 	/* Create an SFN with/without LFNs. */
-	n_ent = (sn[NSFLAG] & NS_LFN) ? (len + 12) / 13 + 1 : 1;	/* Number of entries to allocate */
 	res = dir_alloc(dp, n_ent);		/* Allocate entries */
 	if (res == FR_OK && --n_ent) {	/* Set LFN entry if needed */
 		res = dir_sdi(dp, dp->dptr - n_ent * SZDIRE);
@@ -2671,6 +3280,11 @@ static void get_fileinfo (
 			if (hs == 0 && IsSurrogate(wc)) {	/* Is it a surrogate? */
 				hs = wc; continue;				/* Get low surrogate */
 			}
+#if FF_LFN_UNICODE == 2
+			if (hs == 0 && wc < 0x80 && di < FF_LFN_BUF) {	/* ASCII is stored as is */
+				fno->fname[di++] = (TCHAR)wc; continue;
+			}
+#endif
 			nw = put_utf((DWORD)hs << 16 | wc, &fno->fname[di], FF_LFN_BUF - di);	/* Store it in API encoding */
 			if (nw == 0) {						/* Buffer overflow or wrong char? */
 				di = 0; break;
@@ -2699,6 +3313,11 @@ static void get_fileinfo (
 				if (hs == 0 && IsSurrogate(wc)) {	/* Is it a surrogate? */
 					hs = wc; continue;		/* Get low surrogate */
 				}
+#if FF_LFN_UNICODE == 2
+				if (hs == 0 && wc < 0x80 && di < FF_LFN_BUF) {	/* ASCII is stored as is */
+					fno->fname[di++] = (TCHAR)wc; continue;
+				}
+#endif
 				nw = put_utf((DWORD)hs << 16 | wc, &fno->fname[di], FF_LFN_BUF - di);	/* Store it in API encoding */
 				if (nw == 0) {				/* Buffer overflow or wrong char? */
 					di = 0; break;
@@ -2883,10 +3502,17 @@ static FRESULT create_name (	/* FR_OK: successful, FR_INVALID_NAME: could not cr
 	/* Create LFN into LFN working buffer */
 	p = *path; lfn = dp->obj.fs->lfnbuf; di = 0;
 	for (;;) {
-		uc = tchar2uni(&p);			/* Get a character */
-		if (uc == 0xFFFFFFFF) return FR_INVALID_NAME;		/* Invalid code or UTF decode error */
-		if (uc >= 0x10000) lfn[di++] = (WCHAR)(uc >> 16);	/* Store high surrogate if needed */
-		wc = (WCHAR)uc;
+#if FF_LFN_UNICODE == 2
+		if ((BYTE)*p < 0x80) {		/* ASCII needs no UTF-8 decoding */
+			wc = (BYTE)*p++;
+		} else
+#endif
+		{
+			uc = tchar2uni(&p);			/* Get a character */
+			if (uc == 0xFFFFFFFF) return FR_INVALID_NAME;		/* Invalid code or UTF decode error */
+			if (uc >= 0x10000) lfn[di++] = (WCHAR)(uc >> 16);	/* Store high surrogate if needed */
+			wc = (WCHAR)uc;
+		}
 		if (wc < ' ' || IsSeparator(wc)) break;	/* Break if end of the path or a separator is found */
 		if (wc < 0x80 && strchr("*:<>|\"\?\x7F", (int)wc)) return FR_INVALID_NAME;	/* Reject illegal characters for LFN */
 		if (di >= FF_MAX_LFN) return FR_INVALID_NAME;	/* Reject too long name */
@@ -3070,29 +3696,32 @@ static FRESULT create_name (	/* FR_OK: successful, FR_INVALID_NAME: could not cr
 /* Follow a file path                                                    */
 /*-----------------------------------------------------------------------*/
 
-static FRESULT follow_path (	/* FR_OK(0): successful, !=0: error code */
-	DIR* dp,					/* Directory object to return last directory and found object */
-	const TCHAR* path			/* Full-path string to find a file or directory */
+static FRESULT follow_origin (	/* FR_OK(0): successful, !=0: error code */
+	DIR* dp,					/* Directory object to set the origin directory of the path */
+	const TCHAR** path			/* Pointer to pointer to the path, heading separators are stripped */
 )
 {
-	FRESULT res;
-	BYTE ns;
+#if FF_FS_RPATH != 0
 	FATFS *fs = dp->obj.fs;
+#endif
+	const TCHAR *p = *path;
 
 
 #if FF_FS_RPATH != 0
-	if (!IsSeparator(*path) && (FF_STR_VOLUME_ID != 2 || !IsTerminator(*path))) {	/* Without heading separator */
+	if (!IsSeparator(*p) && (FF_STR_VOLUME_ID != 2 || !IsTerminator(*p))) {	/* Without heading separator */
 		dp->obj.sclust = fs->cdir;			/* Start at the current directory */
 	} else
 #endif
 	{										/* With heading separator */
-		while (IsSeparator(*path)) path++;	/* Strip separators */
+		while (IsSeparator(*p)) p++;		/* Strip separators */
 		dp->obj.sclust = 0;					/* Start from the root directory */
 	}
+	*path = p;
 #if FF_FS_EXFAT
 	dp->obj.n_frag = 0;	/* Invalidate last fragment counter of the object */
 #if FF_FS_RPATH != 0
 	if (fs->fs_type == FS_EXFAT && dp->obj.sclust) {	/* exFAT: Retrieve the sub-directory's status */
+		FRESULT res;
 		DIR dj;
 
 		dp->obj.c_scl = fs->cdc_scl;
@@ -3105,6 +3734,42 @@ static FRESULT follow_path (	/* FR_OK(0): successful, !=0: error code */
 	}
 #endif
 #endif
+	return FR_OK;
+}
+
+
+static void follow_subdir (
+	DIR* dp						/* Directory object pointing the sub-directory entry to get into */
+)
+{
+	FATFS *fs = dp->obj.fs;
+
+
+#if FF_FS_EXFAT
+	if (fs->fs_type == FS_EXFAT) {	/* Save containing directory information for next dir */
+		dp->obj.c_scl = dp->obj.sclust;
+		dp->obj.c_size = ((DWORD)dp->obj.objsize & 0xFFFFFF00) | dp->obj.stat;
+		dp->obj.c_ofs = dp->blk_ofs;
+		init_alloc_info(fs, &dp->obj);	/* Open next directory */
+	} else
+#endif
+	{
+		dp->obj.sclust = ld_clust(fs, fs->win + dp->dptr % SS(fs));	/* Open next directory */
+	}
+}
+
+
+static FRESULT follow_path (	/* FR_OK(0): successful, !=0: error code */
+	DIR* dp,					/* Directory object to return last directory and found object */
+	const TCHAR* path			/* Full-path string to find a file or directory */
+)
+{
+	FRESULT res;
+	BYTE ns;
+
+
+	res = follow_origin(dp, &path);
+	if (res != FR_OK) return res;
 
 	if ((UINT)*path < ' ') {				/* Null path name is the origin directory itself */
 		dp->fn[NSFLAG] = NS_NONAME;
@@ -3133,17 +3798,7 @@ static FRESULT follow_path (	/* FR_OK(0): successful, !=0: error code */
 			if (!(dp->obj.attr & AM_DIR)) {	/* It is not a sub-directory and cannot follow */
 				res = FR_NO_PATH; break;
 			}
-#if FF_FS_EXFAT
-			if (fs->fs_type == FS_EXFAT) {	/* Save containing directory information for next dir */
-				dp->obj.c_scl = dp->obj.sclust;
-				dp->obj.c_size = ((DWORD)dp->obj.objsize & 0xFFFFFF00) | dp->obj.stat;
-				dp->obj.c_ofs = dp->blk_ofs;
-				init_alloc_info(fs, &dp->obj);	/* Open next directory */
-			} else
-#endif
-			{
-				dp->obj.sclust = ld_clust(fs, fs->win + dp->dptr % SS(fs));	/* Open next directory */
-			}
+			follow_subdir(dp);
 		}
 	}
 
@@ -3314,6 +3969,10 @@ static UINT check_fs (	/* 0:FAT/FAT32 VBR, 1:exFAT VBR, 2:Not FAT and valid BS,
 
 
 	fs->wflag = 0; fs->winsect = (LBA_t)0 - 1;		/* Invaidate window */
+#if FF_FS_FATWIN
+	fs->fwin.flag = 0; fs->fwin.sect = (LBA_t)0 - 1;	/* Invalidate FAT and bitmap windows */
+	fs->bwin.flag = 0; fs->bwin.sect = (LBA_t)0 - 1;
+#endif
 	if (move_window(fs, sect) != FR_OK) return 4;	/* Load the boot sector */
 	sign = ld_word(fs->win + BS_55AA);
 #if FF_FS_EXFAT
@@ -3512,8 +4171,10 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 		if (bcl < 2 || bcl >= fs->n_fatent) return FR_NO_FILESYSTEM;	/* (Wrong cluster#) */
 		fs->bitbase = fs->database + fs->csize * (bcl - 2);	/* Bitmap sector */
 		for (;;) {	/* Check if bitmap is contiguous */
-			if (move_window(fs, fs->fatbase + bcl / (SS(fs) / 4)) != FR_OK) return FR_DISK_ERR;
-			cv = ld_dword(fs->win + bcl % (SS(fs) / 4) * 4);
+			BYTE *win = fat_window(fs, fs->fatbase + bcl / (SS(fs) / 4));
+
+			if (!win) return FR_DISK_ERR;
+			cv = ld_dword(win + bcl % (SS(fs) / 4) * 4);
 			if (cv == 0xFFFFFFFF) break;				/* Last link? */
 			if (cv != ++bcl) return FR_NO_FILESYSTEM;	/* Fragmented bitmap? */
 		}
@@ -3603,6 +4264,16 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 
 	fs->fs_type = (BYTE)fmt;/* FAT sub-type (the filesystem object gets valid) */
 	fs->id = ++Fsid;		/* Volume mount ID */
+#if !FF_FS_READONLY && FF_FS_SYNC_GROUP
+	fs->nsync = 0;			/* No file syncs waiting */
+#endif
+#if !FF_FS_READONLY && FF_FS_AU_SIZE
+	init_au(fs);			/* AU size of the medium */
+#endif
+#if !FF_FS_READONLY && FF_FS_RESERVE
+	memset(fs->rsv, 0, sizeof fs->rsv);	/* No reservations */
+	fs->rsv_clst = (FF_FS_RESERVE + (DWORD)fs->csize * SS(fs) - 1) / ((DWORD)fs->csize * SS(fs));
+#endif
 #if FF_USE_LFN == 1
 	fs->lfnbuf = LfnBuf;	/* Static LFN working buffer */
 #if FF_FS_EXFAT
@@ -3724,6 +4395,125 @@ FRESULT f_mount (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* File buffer window - Multi-sector private buffer of a file            */
+/*-----------------------------------------------------------------------*/
+/* buf[] holds a window of nbs sectors aligned in the cluster, which starts
+/  at bsect. Only the sectors in dlo..dhi-1 are written back when dirty, so
+/  small records are merged in memory instead of a write-back per sector.
+/  Sectors past the end of the file are zero filled when the window is
+/  loaded, so untouched ones in the dirty range are written back as zeros. */
+
+#if !FF_FS_TINY
+static FRESULT fbuf_flush (	/* Returns FR_OK or FR_DISK_ERR */
+	FIL* fp			/* Pointer to the file object */
+)
+{
+#if !FF_FS_READONLY
+	FATFS *fs = fp->obj.fs;
+
+
+	if (fp->flag & FA_DIRTY) {	/* Write-back the dirty sectors */
+		if (disk_write(fs->pdrv, fp->buf + fp->dlo * SS(fs), fp->bsect + fp->dlo, fp->dhi - fp->dlo) != RES_OK) return FR_DISK_ERR;
+		fp->flag &= (BYTE)~FA_DIRTY;
+	}
+#endif
+	return FR_OK;
+}
+
+
+static FRESULT fbuf_load (	/* Returns FR_OK or FR_DISK_ERR */
+	FIL* fp,		/* Pointer to the file object */
+	LBA_t sect		/* Sector of fp->fptr to be brought into the window */
+)
+{
+	FATFS *fs = fp->obj.fs;
+	LBA_t top;
+	FSIZE_t ofs;
+	UINT n = 0;
+
+
+	if (fp->bsect != 0 && sect - fp->bsect < fp->nbs) return FR_OK;	/* Already in the window */
+	if (fbuf_flush(fp) != FR_OK) return FR_DISK_ERR;
+	top = sect - (UINT)((sect - fs->database) & (fp->nbs - 1));	/* Top of the window in the cluster */
+	ofs = (fp->fptr / SS(fs) - (UINT)(sect - top)) * SS(fs);	/* File offset of the window */
+	if (ofs < fp->obj.objsize) {	/* Read only the sectors with file data (no silly filling on the growing edge) */
+		ofs = (fp->obj.objsize - ofs + SS(fs) - 1) / SS(fs);
+		n = (ofs < fp->nbs) ? (UINT)ofs : fp->nbs;
+	}
+	fp->bsect = 0;
+	if (n != 0 && disk_read(fs->pdrv, fp->buf, top, n) != RES_OK) return FR_DISK_ERR;
+#if !FF_FS_READONLY
+	if (n < fp->nbs) memset(fp->buf + n * SS(fs), 0, (fp->nbs - n) * SS(fs));	/* Clear the sectors past the end of the file */
+#endif
+	fp->bsect = top;
+	return FR_OK;
+}
+
+
+#if !FF_FS_READONLY
+static void fbuf_dirty (
+	FIL* fp			/* Pointer to the file object, fp->sect is in the window */
+)
+{
+	WORD i = (WORD)(fp->sect - fp->bsect);
+
+
+	if (!(fp->flag & FA_DIRTY)) {
+		fp->dlo = i; fp->dhi = i + 1;
+		fp->flag |= FA_DIRTY;
+	} else {
+		if (i < fp->dlo) fp->dlo = i;
+		if (i >= fp->dhi) fp->dhi = i + 1;
+	}
+}
+
+
+static void fbuf_overlay (
+	FIL* fp,		/* Pointer to the file object */
+	BYTE* rbuff,	/* Sectors read directly from the disk */
+	LBA_t sect,		/* Top sector of the transfer */
+	UINT cc			/* Number of sectors */
+)
+{
+	FATFS *fs = fp->obj.fs;
+	LBA_t s0, s1;
+
+
+	if (!(fp->flag & FA_DIRTY)) return;
+	s0 = fp->bsect + fp->dlo; s1 = fp->bsect + fp->dhi;	/* Replace the sectors dirty in the window */
+	if (s0 < sect) s0 = sect;
+	if (s1 > sect + cc) s1 = sect + cc;
+	if (s0 < s1) memcpy(rbuff + (UINT)(s0 - sect) * SS(fs), fp->buf + (UINT)(s0 - fp->bsect) * SS(fs), (UINT)(s1 - s0) * SS(fs));
+}
+
+
+static void fbuf_refresh (
+	FIL* fp,		/* Pointer to the file object */
+	const BYTE* wbuff,	/* Sectors written directly to the disk */
+	LBA_t sect,		/* Top sector of the transfer */
+	UINT cc			/* Number of sectors */
+)
+{
+	FATFS *fs = fp->obj.fs;
+	LBA_t s0, s1;
+
+
+	if (fp->bsect == 0) return;
+	s0 = fp->bsect; s1 = fp->bsect + fp->nbs;	/* Refill the sectors in the window invalidated by the transfer */
+	if (s0 < sect) s0 = sect;
+	if (s1 > sect + cc) s1 = sect + cc;
+	if (s0 < s1) {
+		memcpy(fp->buf + (UINT)(s0 - fp->bsect) * SS(fs), wbuff + (UINT)(s0 - sect) * SS(fs), (UINT)(s1 - s0) * SS(fs));
+		if (fp->bsect + fp->dlo >= s0 && fp->bsect + fp->dhi <= s1) fp->flag &= (BYTE)~FA_DIRTY;	/* All dirty sectors got written */
+	}
+}
+#endif
+#endif	/* !FF_FS_TINY */
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Open or Create a File                                                 */
 /*-----------------------------------------------------------------------*/
@@ -3874,13 +4664,20 @@ FRESULT f_open (
 #endif
 			fp->obj.fs = fs;	/* Validate the file object */
 			fp->obj.id = fs->id;
+#if !FF_FS_READONLY && FF_FS_RESERVE
+			rsv_release(&fp->obj);	/* Drop a reservation left at this object by a file not closed */
+#endif
 			fp->flag = mode;	/* Set file access mode */
 			fp->err = 0;		/* Clear error flag */
 			fp->sect = 0;		/* Invalidate current data sector */
 			fp->fptr = 0;		/* Set file pointer top of the file */
+#if !FF_FS_TINY
+			fp->bsect = 0;		/* Invalidate buffer window */
+			for (fp->nbs = fp->nbuf ? fp->nbuf : 1; fp->nbs > fs->csize; fp->nbs /= 2) ;	/* Window does not cross the cluster */
+#endif
 #if !FF_FS_READONLY
 #if !FF_FS_TINY
-			memset(fp->buf, 0, FF_MAX_SS);	/* Clear sector buffer */
+			memset(fp->buf, 0, SS(fs) * fp->nbs);	/* Clear buffer window */
 #endif
 			if ((mode & FA_SEEKEND) && fp->obj.objsize > 0) {	/* Seek to end of file if FA_OPEN_APPEND is specified */
 				fp->fptr = fp->obj.objsize;			/* Offset to seek */
@@ -3899,7 +4696,7 @@ FRESULT f_open (
 					} else {
 						fp->sect = sc + (DWORD)(ofs / SS(fs));
 #if !FF_FS_TINY
-						if (disk_read(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) res = FR_DISK_ERR;
+						res = fbuf_load(fp, fp->sect);
 #endif
 					}
 				}
@@ -3958,6 +4755,7 @@ FRESULT f_read (
 			if (csect == 0) {					/* On the cluster boundary? */
 				if(next_clst) {
 					clst = next_clst; /* was already located in previous iteration */
+					next_clst = 0;
 				} else 	if (fp->fptr == 0) {			/* On the top of the file? */
 					clst = fp->obj.sclust;		/* Follow cluster chain from the origin */
 				} else {						/* Middle or end of the file */				
@@ -3978,7 +4776,7 @@ FRESULT f_read (
 				for(clust_count = 1; clust_count< clst_to_read; clust_count++) {
 #if FF_USE_FASTSEEK
 					if (fp->cltbl) {
-						next_clst = clmt_clust(fp, fp->fptr);	/* Get cluster# from the CLMT */
+						next_clst = clmt_clust(fp, fp->fptr + (FSIZE_t)clust_count * fs->csize * SS(fs));	/* Get cluster# from the CLMT */
 					} else
 #endif
 					next_clst = get_fat(&fp->obj, end_clst);
@@ -4004,9 +4802,7 @@ FRESULT f_read (
 					memcpy(rbuff + ((fs->winsect - sect) * SS(fs)), fs->win, SS(fs));
 				}
 #else
-				if ((fp->flag & FA_DIRTY) && fp->sect - sect < cc) {
-					memcpy(rbuff + ((fp->sect - sect) * SS(fs)), fp->buf, SS(fs));
-				}
+				fbuf_overlay(fp, rbuff, sect, cc);
 #endif
 #endif
 				rcnt = SS(fs) * cc;				/* Number of bytes transferred */
@@ -4015,15 +4811,7 @@ FRESULT f_read (
 				continue;
 			}
 #if !FF_FS_TINY
-			if (fp->sect != sect) {			/* Load data sector if not in cache */
-#if !FF_FS_READONLY
-				if (fp->flag & FA_DIRTY) {		/* Write-back dirty sector cache */
-					if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
-					fp->flag &= (BYTE)~FA_DIRTY;
-				}
-#endif
-				if (disk_read(fs->pdrv, fp->buf, sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);	/* Fill sector cache */
-			}
+			if (fbuf_load(fp, sect) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Bring the data sector into the buffer window */
 #endif
 			fp->sect = sect;
 		}
@@ -4033,7 +4821,7 @@ FRESULT f_read (
 		if (move_window(fs, fp->sect) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Move sector window */
 		memcpy(rbuff, fs->win + fp->fptr % SS(fs), rcnt);	/* Extract partial sector */
 #else
-		memcpy(rbuff, fp->buf + fp->fptr % SS(fs), rcnt);	/* Extract partial sector */
+		memcpy(rbuff, fp->buf + (UINT)(fp->sect - fp->bsect) * SS(fs) + fp->fptr % SS(fs), rcnt);	/* Extract partial sector */
 #endif
 	}
 
@@ -4067,6 +4855,9 @@ FRESULT f_write (
 	res = validate(&fp->obj, &fs);			/* Check validity of the file object */
 	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);	/* Check validity */
 	if (!(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);	/* Check access mode */
+#if FF_FS_RESERVE
+	if (fp->fptr + btw > fp->obj.objsize) rsv_slot(&fp->obj, 1);	/* A growing file reserves clusters ahead */
+#endif
 
 	/* Check fptr wrap-around (file size cannot reach 4 GiB at FAT volume) */
 	if ((!FF_FS_EXFAT || fs->fs_type != FS_EXFAT) && (DWORD)(fp->fptr + btw) < (DWORD)fp->fptr) {
@@ -4083,6 +4874,7 @@ FRESULT f_write (
 			if (csect == 0) {				/* On the cluster boundary? */
 				if(next_clst) {
 						clst = next_clst; /* was already allocated in previous iteration */
+						next_clst = 0;
 				} else if (fp->fptr == 0) {		/* On the top of the file? */
 					clst = fp->obj.sclust;	/* Follow from the origin */
 					if (clst == 0) {		/* If no cluster is allocated, */
@@ -4104,30 +4896,31 @@ FRESULT f_write (
 				fp->clust = clst;			/* Update current cluster */
 				if (fp->obj.sclust == 0) fp->obj.sclust = clst;	/* Set start cluster if the first write */
 				UINT clst_to_write = ((cc + fs->csize -1) / fs->csize); // round up
+				FSIZE_t osz = fp->obj.objsize;
 				end_clst = clst;
 				for(clust_count = 1; clust_count< clst_to_write; clust_count++) {
 #if FF_USE_FASTSEEK
 					if (fp->cltbl) {
-						next_clst = clmt_clust(fp, fp->fptr);	/* Get cluster# from the CLMT */
+						next_clst = clmt_clust(fp, fp->fptr + (FSIZE_t)clust_count * fs->csize * SS(fs));	/* Get cluster# from the CLMT */
 					} else
 #endif
-					next_clst = create_chain(&fp->obj, end_clst);
+					{
+						FSIZE_t eofs = fp->fptr + (FSIZE_t)(clust_count - 1) * fs->csize * SS(fs) + 1;	/* Data length covering end_clst */
+						if (fp->obj.objsize < eofs) fp->obj.objsize = eofs;	/* exFAT get_fat() needs it to find the end of a contiguous chain */
+						next_clst = create_chain(&fp->obj, end_clst);
+					}
 					if(next_clst != end_clst +1)
 						break;
 					end_clst = next_clst;
 					next_clst = 0;
 				}
+				fp->obj.objsize = osz;
 				if (next_clst == 1) ABORT(fs, FR_INT_ERR);
 				if (next_clst == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
 
 			}
 #if FF_FS_TINY
 			if (fs->winsect == fp->sect && sync_window(fs) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Write-back sector cache */
-#else
-			if (fp->flag & FA_DIRTY) {		/* Write-back sector cache */
-				if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
-				fp->flag &= (BYTE)~FA_DIRTY;
-			}
 #endif
 			sect = clst2sect(fs, fp->clust);	/* Get current sector */
 			if (sect == 0) ABORT(fs, FR_INT_ERR);
@@ -4144,10 +4937,7 @@ FRESULT f_write (
 					fs->wflag = 0;
 				}
 #else
-				if (fp->sect - sect < cc) { /* Refill sector cache if it gets invalidated by the direct write */
-					memcpy(fp->buf, wbuff + ((fp->sect - sect) * SS(fs)), SS(fs));
-					fp->flag &= (BYTE)~FA_DIRTY;
-				}
+				fbuf_refresh(fp, wbuff, sect, cc);	/* Refill buffer window if it gets invalidated by the direct write */
 #endif
 #endif
 				wcnt = SS(fs) * cc;		/* Number of bytes transferred */
@@ -4161,11 +4951,7 @@ FRESULT f_write (
 				fs->winsect = sect;
 			}
 #else
-			if (fp->sect != sect && 		/* Fill sector cache with file data */
-				fp->fptr < fp->obj.objsize &&
-				disk_read(fs->pdrv, fp->buf, sect, 1) != RES_OK) {
-					ABORT(fs, FR_DISK_ERR);
-			}
+			if (fbuf_load(fp, sect) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Bring the data sector into the buffer window */
 #endif
 			fp->sect = sect;
 		}
@@ -4176,8 +4962,8 @@ FRESULT f_write (
 		memcpy(fs->win + fp->fptr % SS(fs), wbuff, wcnt);	/* Fit data to the sector */
 		fs->wflag = 1;
 #else
-		memcpy(fp->buf + fp->fptr % SS(fs), wbuff, wcnt);	/* Fit data to the sector */
-		fp->flag |= FA_DIRTY;
+		memcpy(fp->buf + (UINT)(fp->sect - fp->bsect) * SS(fs) + fp->fptr % SS(fs), wbuff, wcnt);	/* Fit data to the sector */
+		fbuf_dirty(fp);
 #endif
 	}
 
@@ -4207,10 +4993,7 @@ FRESULT f_sync (
 	if (res == FR_OK) {
 		if (fp->flag & FA_MODIFIED) {	/* Is there any change to the file? */
 #if !FF_FS_TINY
-			if (fp->flag & FA_DIRTY) {	/* Write-back cached data if needed */
-				if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) LEAVE_FF(fs, FR_DISK_ERR);
-				fp->flag &= (BYTE)~FA_DIRTY;
-			}
+			if (fbuf_flush(fp) != FR_OK) LEAVE_FF(fs, FR_DISK_ERR);	/* Write-back cached data if needed */
 #endif
 			/* Update the directory entry */
 			tm = GET_FATTIME();				/* Modified time */
@@ -4237,7 +5020,7 @@ FRESULT f_sync (
 						st_dword(fs->dirbuf + XDIR_AccTime, 0);
 						res = store_xdir(&dj);	/* Restore it to the directory */
 						if (res == FR_OK) {
-							res = sync_fs(fs);
+							res = sync_group(fs, tm);
 							fp->flag &= (BYTE)~FA_MODIFIED;
 						}
 					}
@@ -4255,7 +5038,7 @@ FRESULT f_sync (
 					st_dword(dir + DIR_ModTime, tm);				/* Update modified time */
 					st_word(dir + DIR_LstAccDate, 0);
 					fs->wflag = 1;
-					res = sync_fs(fs);					/* Restore it to the directory */
+					res = sync_group(fs, tm);			/* Restore it to the directory */
 					fp->flag &= (BYTE)~FA_MODIFIED;
 				}
 			}
@@ -4265,6 +5048,42 @@ FRESULT f_sync (
 	LEAVE_FF(fs, res);
 }
 
+
+
+
+#if FF_FS_SYNC_GROUP || FF_FS_LAZY_FSINFO
+/*-----------------------------------------------------------------------*/
+/* Flush the File Syncs and Allocation Information Waiting on the Volume */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_syncfs (
+	const TCHAR* path,	/* Logical drive number */
+	BYTE opt			/* 0:Flush if the group is due, 1:Flush now */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+
+
+	res = mount_volume(&path, &fs, 0);
+	if (res == FR_OK) {
+#if FF_FS_SYNC_GROUP
+		if (!opt && !(fs->nsync && sync_expired(fs, GET_FATTIME()))) LEAVE_FF(fs, FR_OK);	/* Nothing due */
+#endif
+		res = sync_windows(fs);		/* Directory and FAT first */
+#if FF_FS_LAZY_FSINFO
+		if (res == FR_OK && (fs->fsi_flag & 0x81) == 1) {	/* Allocation changed? */
+			put_fsinfo(fs, 1);
+			fs->fsi_flag = 0;
+		}
+#endif
+		if (res == FR_OK) res = sync_fs(fs);
+	}
+
+	LEAVE_FF(fs, res);
+}
+#endif
+
 #endif /* !FF_FS_READONLY */
 
 
@@ -4283,11 +5102,20 @@ FRESULT f_close (
 
 #if !FF_FS_READONLY
 	res = f_sync(fp);					/* Flush cached data */
+#if FF_FS_RESERVE
+	if (res != FR_OK && validate(&fp->obj, &fs) == FR_OK) {
+		rsv_release(&fp->obj);			/* Return the unused reservation, a retried write takes a new one */
+		LEAVE_FF(fs, res);
+	}
+#endif
 	if (res == FR_OK)
 #endif
 	{
 		res = validate(&fp->obj, &fs);	/* Lock volume */
 		if (res == FR_OK) {
+#if !FF_FS_READONLY && FF_FS_RESERVE
+			rsv_release(&fp->obj);		/* Return the unused reservation */
+#endif
 #if FF_FS_LOCK
 			res = dec_share(fp->obj.lockid);		/* Decrement file open counter */
 			if (res == FR_OK) fp->obj.fs = 0;	/* Invalidate file object */
@@ -4553,13 +5381,7 @@ FRESULT f_lseek (
 				dsc += (DWORD)((ofs - 1) / SS(fs)) & (fs->csize - 1);
 				if (fp->fptr % SS(fs) && dsc != fp->sect) {	/* Refill sector cache if needed */
 #if !FF_FS_TINY
-#if !FF_FS_READONLY
-					if (fp->flag & FA_DIRTY) {		/* Write-back dirty sector cache */
-						if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
-						fp->flag &= (BYTE)~FA_DIRTY;
-					}
-#endif
-					if (disk_read(fs->pdrv, fp->buf, dsc, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);	/* Load current sector */
+					if (fbuf_load(fp, dsc) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Load current sector */
 #endif
 					fp->sect = dsc;
 				}
@@ -4633,13 +5455,7 @@ FRESULT f_lseek (
 		}
 		if (fp->fptr % SS(fs) && nsect != fp->sect) {	/* Fill sector cache if needed */
 #if !FF_FS_TINY
-#if !FF_FS_READONLY
-			if (fp->flag & FA_DIRTY) {			/* Write-back dirty sector cache */
-				if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
-				fp->flag &= (BYTE)~FA_DIRTY;
-			}
-#endif
-			if (disk_read(fs->pdrv, fp->buf, nsect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);	/* Fill sector cache */
+			if (fbuf_load(fp, nsect) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Fill sector cache */
 #endif
 			fp->sect = nsect;
 		}
@@ -4870,6 +5686,58 @@ FRESULT f_stat (
 
 
 #if !FF_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* Get Status of an Open File                                            */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_fstat (
+	FIL* fp,			/* Pointer to the open file object */
+	FILINFO* fno		/* Pointer to file information to return (the names are left blank) */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	BYTE *dir;
+
+
+	res = validate(&fp->obj, &fs);	/* Check validity of the file object */
+	if (res == FR_OK) {
+		fno->fname[0] = 0;
+#if FF_USE_LFN
+		fno->altname[0] = 0;
+#endif
+#if FF_FS_EXFAT
+		if (fs->fs_type == FS_EXFAT) {
+			DIR dj;
+			DEF_NAMBUF
+
+			INIT_NAMBUF(fs);
+			res = load_obj_xdir(&dj, &fp->obj);	/* Load directory entry block */
+			if (res == FR_OK) {
+				fno->fattrib = fs->dirbuf[XDIR_Attr] & AM_MASKX;
+				fno->ftime = ld_word(fs->dirbuf + XDIR_ModTime + 0);
+				fno->fdate = ld_word(fs->dirbuf + XDIR_ModTime + 2);
+			}
+			FREE_NAMBUF();
+		} else
+#endif
+		{
+			res = move_window(fs, fp->dir_sect);	/* Load the directory entry */
+			if (res == FR_OK) {
+				dir = fp->dir_ptr;
+				fno->fattrib = dir[DIR_Attr] & AM_MASK;
+				fno->ftime = ld_word(dir + DIR_ModTime + 0);
+				fno->fdate = ld_word(dir + DIR_ModTime + 2);
+			}
+		}
+		fno->fsize = fp->obj.objsize;	/* Current size including the data not synced yet */
+	}
+
+	LEAVE_FF(fs, res);
+}
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Get Number of Free Clusters                                           */
 /*-----------------------------------------------------------------------*/
@@ -4885,6 +5753,7 @@ FRESULT f_getfree (
 	DWORD nfree, clst, stat;
 	LBA_t sect;
 	UINT i;
+	BYTE *win = 0;
 	FFOBJID obj;
 
 
@@ -4921,10 +5790,11 @@ FRESULT f_getfree (
 					i = 0;						/* Offset in the sector */
 					do {	/* Counts numbuer of clear bits (free clusters) in the bitmap */
 						if (i == 0) {	/* New sector? */
-							res = move_window(fs, sect++);
-							if (res != FR_OK) break;
+							if ((win = bmp_window(fs, sect++)) == 0) {
+								res = FR_DISK_ERR; break;
+							}
 						}
-						for (b = 8, bm = ~fs->win[i]; b && clst; b--, clst--) {	/* Count clear bits in a byte */
+						for (b = 8, bm = ~win[i]; b && clst; b--, clst--) {	/* Count clear bits in a byte */
 							nfree += bm & 1;
 							bm >>= 1;
 						}
@@ -4938,14 +5808,15 @@ FRESULT f_getfree (
 					i = 0;					/* Offset in the sector */
 					do {	/* Counts numbuer of entries with zero in the FAT */
 						if (i == 0) {	/* New sector? */
-							res = move_window(fs, sect++);
-							if (res != FR_OK) break;
+							if ((win = fat_window(fs, sect++)) == 0) {
+								res = FR_DISK_ERR; break;
+							}
 						}
 						if (fs->fs_type == FS_FAT16) {
-							if (ld_word(fs->win + i) == 0) nfree++;	/* FAT16: Is this cluster free? */
+							if (ld_word(win + i) == 0) nfree++;	/* FAT16: Is this cluster free? */
 							i += 2;	/* Next entry */
 						} else {
-							if ((ld_dword(fs->win + i) & 0x0FFFFFFF) == 0) nfree++;	/* FAT32: Is this cluster free? */
+							if ((ld_dword(win + i) & 0x0FFFFFFF) == 0) nfree++;	/* FAT32: Is this cluster free? */
 							i += 4;	/* Next entry */
 						}
 						i %= SS(fs);
@@ -4999,12 +5870,10 @@ FRESULT f_truncate (
 		fp->obj.objsize = fp->fptr;	/* Set file size to current read/write point */
 		fp->flag |= FA_MODIFIED;
 #if !FF_FS_TINY
-		if (res == FR_OK && (fp->flag & FA_DIRTY)) {
-			if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) {
-				res = FR_DISK_ERR;
-			} else {
-				fp->flag &= (BYTE)~FA_DIRTY;
-			}
+		if (res == FR_OK) res = fbuf_flush(fp);
+		if (fp->fptr % SS(fs) == 0) {	/* The window may be on the removed clusters */
+			fp->bsect = 0;
+			fp->sect = 0;	/* and a seek into the current sector has to load it again */
 		}
 #endif
 		if (res != FR_OK) ABORT(fs, res);
@@ -5114,6 +5983,67 @@ FRESULT f_unlink (
 /* Create a Directory                                                    */
 /*-----------------------------------------------------------------------*/
 
+static FRESULT create_dir (	/* FR_OK(0): successful, !=0: error code */
+	DIR* dp,				/* Parent directory with the new name found missing by dir_find() */
+	DWORD tm,				/* Timestamp of the new directory */
+	const BYTE* zbuf,		/* Zero filled buffer for dir_clear_buf (null:allocate on demand) */
+	UINT zsz				/* Size of the zero filled buffer [sectors] */
+)
+{
+	FRESULT res;
+	FATFS *fs = dp->obj.fs;
+	FFOBJID sobj;
+	DWORD dcl, pcl;
+
+
+	sobj.fs = fs;						/* New object id to create a new chain */
+	dcl = create_chain(&sobj, 0);		/* Allocate a cluster for the new directory */
+	res = FR_OK;
+	if (dcl == 0) res = FR_DENIED;		/* No space to allocate a new cluster? */
+	if (dcl == 1) res = FR_INT_ERR;		/* Any insanity? */
+	if (dcl == 0xFFFFFFFF) res = FR_DISK_ERR;	/* Disk error? */
+	if (res == FR_OK) {
+		res = zbuf ? dir_clear_buf(fs, dcl, zbuf, zsz) : dir_clear(fs, dcl);	/* Clean up the new table */
+		if (res == FR_OK) {
+			if (!FF_FS_EXFAT || fs->fs_type != FS_EXFAT) {	/* Create dot entries (FAT only) */
+				memset(fs->win + DIR_Name, ' ', 11);	/* Create "." entry */
+				fs->win[DIR_Name] = '.';
+				fs->win[DIR_Attr] = AM_DIR;
+				st_dword(fs->win + DIR_ModTime, tm);
+				st_clust(fs, fs->win, dcl);
+				memcpy(fs->win + SZDIRE, fs->win, SZDIRE);	/* Create ".." entry */
+				fs->win[SZDIRE + 1] = '.'; pcl = dp->obj.sclust;
+				st_clust(fs, fs->win + SZDIRE, pcl);
+				fs->wflag = 1;
+			}
+			res = dir_register(dp);	/* Register the object to the parent directory */
+		}
+	}
+	if (res == FR_OK) {
+#if FF_FS_EXFAT
+		if (fs->fs_type == FS_EXFAT) {	/* Initialize directory entry block */
+			st_dword(fs->dirbuf + XDIR_ModTime, tm);	/* Created time */
+			st_dword(fs->dirbuf + XDIR_FstClus, dcl);	/* Table start cluster */
+			st_dword(fs->dirbuf + XDIR_FileSize, (DWORD)fs->csize * SS(fs));	/* Directory size needs to be valid */
+			st_dword(fs->dirbuf + XDIR_ValidFileSize, (DWORD)fs->csize * SS(fs));
+			fs->dirbuf[XDIR_GenFlags] = 3;				/* Initialize the object flag */
+			fs->dirbuf[XDIR_Attr] = AM_DIR;				/* Attribute */
+			res = store_xdir(dp);
+		} else
+#endif
+		{
+			st_dword(dp->dir + DIR_ModTime, tm);	/* Created time */
+			st_clust(fs, dp->dir, dcl);			/* Table start cluster */
+			dp->dir[DIR_Attr] = AM_DIR;			/* Attribute */
+			fs->wflag = 1;
+		}
+	} else {
+		remove_chain(&sobj, dcl, 0);		/* Could not register, remove the allocated cluster */
+	}
+	return res;
+}
+
+
 FRESULT f_mkdir (
 	const TCHAR* path		/* Pointer to the directory path */
 )
@@ -5121,8 +6051,6 @@ FRESULT f_mkdir (
 	FRESULT res;
 	FATFS *fs;
 	DIR dj;
-	FFOBJID sobj;
-	DWORD dcl, pcl, tm;
 	DEF_NAMBUF
 
 
@@ -5136,55 +6064,82 @@ FRESULT f_mkdir (
 			res = FR_INVALID_NAME;
 		}
 		if (res == FR_NO_FILE) {				/* It is clear to create a new directory */
-			sobj.fs = fs;						/* New object id to create a new chain */
-			dcl = create_chain(&sobj, 0);		/* Allocate a cluster for the new directory */
-			res = FR_OK;
-			if (dcl == 0) res = FR_DENIED;		/* No space to allocate a new cluster? */
-			if (dcl == 1) res = FR_INT_ERR;		/* Any insanity? */
-			if (dcl == 0xFFFFFFFF) res = FR_DISK_ERR;	/* Disk error? */
-			tm = GET_FATTIME();
+			res = create_dir(&dj, GET_FATTIME(), 0, 0);
 			if (res == FR_OK) {
-				res = dir_clear(fs, dcl);		/* Clean up the new table */
-				if (res == FR_OK) {
-					if (!FF_FS_EXFAT || fs->fs_type != FS_EXFAT) {	/* Create dot entries (FAT only) */
-						memset(fs->win + DIR_Name, ' ', 11);	/* Create "." entry */
-						fs->win[DIR_Name] = '.';
-						fs->win[DIR_Attr] = AM_DIR;
-						st_dword(fs->win + DIR_ModTime, tm);
-						st_clust(fs, fs->win, dcl);
-						memcpy(fs->win + SZDIRE, fs->win, SZDIRE);	/* Create ".." entry */
-						fs->win[SZDIRE + 1] = '.'; pcl = dj.obj.sclust;
-						st_clust(fs, fs->win + SZDIRE, pcl);
-						fs->wflag = 1;
-					}
-					res = dir_register(&dj);	/* Register the object to the parent directory */
-				}
+				res = sync_fs(fs);
 			}
-			if (res == FR_OK) {
-#if FF_FS_EXFAT
-				if (fs->fs_type == FS_EXFAT) {	/* Initialize directory entry block */
-					st_dword(fs->dirbuf + XDIR_ModTime, tm);	/* Created time */
-					st_dword(fs->dirbuf + XDIR_FstClus, dcl);	/* Table start cluster */
-					st_dword(fs->dirbuf + XDIR_FileSize, (DWORD)fs->csize * SS(fs));	/* Directory size needs to be valid */
-					st_dword(fs->dirbuf + XDIR_ValidFileSize, (DWORD)fs->csize * SS(fs));
-					fs->dirbuf[XDIR_GenFlags] = 3;				/* Initialize the object flag */
-					fs->dirbuf[XDIR_Attr] = AM_DIR;				/* Attribute */
-					res = store_xdir(&dj);
-				} else
-#endif
-				{
-					st_dword(dj.dir + DIR_ModTime, tm);	/* Created time */
-					st_clust(fs, dj.dir, dcl);			/* Table start cluster */
-					dj.dir[DIR_Attr] = AM_DIR;			/* Attribute */
-					fs->wflag = 1;
+		}
+		FREE_NAMBUF();
+	}
+
+	LEAVE_FF(fs, res);
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Create a Directory and all its Missing Parents                        */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_mkpath (
+	const TCHAR* path		/* Pointer to the directory path */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DIR dj;
+	BYTE ns, created = 0;
+	const BYTE *zbuf = 0;
+	UINT zsz = 0;
+	DWORD tm = 0;
+	DEF_NAMBUF
+
+
+	res = mount_volume(&path, &fs, FA_WRITE);	/* Get logical drive */
+	if (res == FR_OK) {
+		dj.obj.fs = fs;
+		INIT_NAMBUF(fs);
+		res = follow_origin(&dj, &path);
+		if (res == FR_OK && (UINT)*path < ' ') res = FR_EXIST;	/* The origin directory itself */
+		while (res == FR_OK) {	/* Walk the path once, descending into existing or new directories */
+			res = create_name(&dj, &path);		/* Get a segment name of the path */
+			if (res != FR_OK) break;
+			ns = dj.fn[NSFLAG];
+			res = dir_find(&dj);				/* Find an object with the segment name */
+			if (res == FR_OK) {					/* Existing object */
+				if (ns & NS_LAST) {
+					res = FR_EXIST; break;
 				}
-				if (res == FR_OK) {
-					res = sync_fs(fs);
+				if (!(dj.obj.attr & AM_DIR)) {	/* It is not a sub-directory and cannot follow */
+					res = FR_NO_PATH; break;
 				}
 			} else {
-				remove_chain(&sobj, dcl, 0);		/* Could not register, remove the allocated cluster */
+				if (res != FR_NO_FILE) break;
+				if (FF_FS_RPATH && (ns & NS_DOT)) {	/* Cannot create dot names */
+					res = FR_INVALID_NAME; break;
+				}
+				if (!created) {					/* First missing segment, the remaining ones are all new */
+					tm = GET_FATTIME();
+#if FF_USE_LFN == 3
+					zbuf = alloc_zbuf(fs, &zsz);	/* Share the table clear buffer among the new levels */
+#endif
+				}
+				res = create_dir(&dj, tm, zbuf, zsz);
+				if (res != FR_OK) break;
+				created = 1;
+				if (ns & NS_LAST) break;
 			}
+			follow_subdir(&dj);					/* Get into the sub-directory */
+		}
+		if (created) {		/* Flush the directories created so far even on a later error */
+			FRESULT sres = sync_fs(fs);
+
+			if (res == FR_OK) res = sres;
 		}
+#if FF_USE_LFN == 3
+		free_zbuf(zbuf);
+#endif
 		FREE_NAMBUF();
 	}
 
@@ -5647,6 +6602,12 @@ FRESULT f_expand (
 	tcl = (DWORD)(fsz / n) + ((fsz & (n - 1)) ? 1 : 0);	/* Number of clusters required */
 	stcl = fs->last_clst; lclst = 0;
 	if (stcl < 2 || stcl >= fs->n_fatent) stcl = 2;
+#if FF_FS_AU_SIZE
+	if (fs->au_clst != 0 && tcl >= fs->au_clst) {	/* Is it a large block? */
+		scl = find_au_block(&fp->obj, stcl, tcl);	/* Find a free one at an AU boundary */
+		if (scl >= 2 && scl != 0xFFFFFFFF) stcl = scl;	/* and let the search start there */
+	}
+#endif
 
 #if FF_FS_EXFAT
 	if (fs->fs_type == FS_EXFAT) {
@@ -5764,16 +6725,8 @@ FRESULT f_forward (
 		if (move_window(fs, sect) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Move sector window to the file data */
 		dbuf = fs->win;
 #else
-		if (fp->sect != sect) {		/* Fill sector cache with file data */
-#if !FF_FS_READONLY
-			if (fp->flag & FA_DIRTY) {		/* Write-back dirty sector cache */
-				if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
-				fp->flag &= (BYTE)~FA_DIRTY;
-			}
-#endif
-			if (disk_read(fs->pdrv, fp->buf, sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
-		}
-		dbuf = fp->buf;
+		if (fbuf_load(fp, sect) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Fill sector cache with file data */
+		dbuf = fp->buf + (UINT)(sect - fp->bsect) * SS(fs);
 #endif
 		fp->sect = sect;
 		rcnt = SS(fs) - (UINT)fp->fptr % SS(fs);	/* Number of bytes remains in the sector */
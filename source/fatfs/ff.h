@@ -128,8 +128,41 @@ extern const char* VolumeStr[FF_VOLUMES];	/* User defined volume ID table */
 
 
 
+/* Sector window for the FAT or the allocation bitmap (FF_FS_FATWIN) */
+
+#if FF_FS_FATWIN
+typedef struct {
+	BYTE*	buf;			/* Sector buffer (null:use the common window) */
+	LBA_t	sect;			/* Sector LBA in buf[] */
+	BYTE	flag;			/* buf[] status (1:dirty) */
+} FFWIN;
+#endif
+
+
+
+/* Clusters reserved for a file being written (FF_FS_RESERVE) */
+
+#if FF_FS_RESERVE
+typedef struct {
+	void*	obj;			/* Owner object (null:free slot) */
+	DWORD	scl;			/* First reserved cluster */
+	DWORD	ecl;			/* Cluster after the reservation */
+	DWORD	use;			/* Time of last allocation (for replacement) */
+} FFRSV;
+#endif
+
+
+
 /* Filesystem object structure (FATFS) */
 
+#if FF_USE_LFN == 3 && FF_VOL_WORKBUF	/* Size of the per-volume working buffer for lfnbuf and dirbuf */
+#if FF_FS_EXFAT
+#define FF_WORKBUF_SIZE	((FF_MAX_LFN + 1) * 2 + (FF_MAX_LFN + 44U) / 15 * 32)
+#else
+#define FF_WORKBUF_SIZE	((FF_MAX_LFN + 1) * 2)
+#endif
+#endif
+
 typedef struct {
 	BYTE	fs_type;		/* Filesystem type (0:blank filesystem object) */
 	BYTE	pdrv;			/* Volume hosting physical drive */
@@ -149,9 +182,33 @@ typedef struct {
 #if FF_FS_EXFAT
 	BYTE*	dirbuf;			/* Directory entry block scratch pad buffer for exFAT */
 #endif
+#if FF_USE_LFN == 3 && FF_VOL_WORKBUF
+	const BYTE*	zbuf;		/* Zero filled buffer to clear directory tables (null:use the window) */
+	UINT	zbsize;			/* Size of zbuf [bytes] */
+#endif
 #if !FF_FS_READONLY
 	DWORD	last_clst;		/* Last allocated cluster (Unknown if >= n_fatent) */
 	DWORD	free_clst;		/* Number of free clusters (Unknown if >= n_fatent-2) */
+#if FF_FS_SYNC_GROUP
+	UINT	nsync;			/* Number of file syncs waiting for the volume flush */
+	DWORD	sync_tm;		/* Timestamp of the oldest waiting file sync */
+#endif
+#if FF_FS_FATWIN
+	FFWIN	fwin;			/* FAT window */
+	FFWIN	bwin;			/* exFAT allocation bitmap window */
+#endif
+#if FF_FS_LAZY_FSINFO
+	BYTE*	ibuf;			/* Buffer for the FSInfo sector and the VBR (null:use the window) */
+#endif
+#if FF_FS_AU_SIZE
+	DWORD	au_clst;		/* Clusters per AU (0:AU alignment not used) */
+	BYTE	au_full;		/* No free AU was found since the last cluster release */
+#endif
+#if FF_FS_RESERVE
+	DWORD	rsv_clst;		/* Clusters to reserve ahead of a growing file */
+	DWORD	rsv_use;		/* Counter for FFRSV.use */
+	FFRSV	rsv[FF_FS_RESERVE_FILES];	/* Reservations of the files being written */
+#endif
 #endif
 #if FF_FS_RPATH
 	DWORD	cdir;			/* Current directory start cluster (0:root) */
@@ -207,7 +264,7 @@ typedef struct {
 	BYTE	err;			/* Abort flag (error code) */
 	FSIZE_t	fptr;			/* File read/write pointer (Zeroed on file open) */
 	DWORD	clust;			/* Current cluster of fpter (invalid when fptr is 0) */
-	LBA_t	sect;			/* Sector number appearing in buf[] (0:invalid) */
+	LBA_t	sect;			/* Sector number of fptr in buf[] (0:invalid) */
 #if !FF_FS_READONLY
 	LBA_t	dir_sect;		/* Sector number containing the directory entry (not used at exFAT) */
 	BYTE*	dir_ptr;		/* Pointer to the directory entry in the win[] (not used at exFAT) */
@@ -217,6 +274,10 @@ typedef struct {
 #endif
 #if !FF_FS_TINY
 	BYTE	*buf; //[FF_MAX_SS];	/* File private data read/write window */
+	WORD	nbuf;			/* Size of buf[] in sectors, power of 2 (set by the owner before f_open, 0:one sector) */
+	WORD	nbs;			/* Number of sectors in the window (nbuf clipped at the cluster size) */
+	WORD	dlo, dhi;		/* Dirty sectors in the window (valid with FA_DIRTY) */
+	LBA_t	bsect;			/* Top sector of the window in buf[] (0:invalid) */
 #endif
 } FIL;
 
@@ -234,6 +295,12 @@ typedef struct {
 #if FF_USE_LFN
 	DWORD	blk_ofs;		/* Offset of current entry block being processed (0xFFFFFFFF:Invalid) */
 #endif
+#if !FF_FS_READONLY
+	DWORD	alloc_ofs;		/* Free block for dir_alloc found while scanning the table (0xFFFFFFFF:Unknown) */
+	DWORD	free_ofs;		/* Offset of the free block being tracked */
+	WORD	free_n;			/* Number of entries in the free block being tracked */
+	WORD	alloc_n;		/* Number of entries alloc_ofs is tracked for */
+#endif
 #if FF_USE_FIND
 	const TCHAR* pat;		/* Pointer to the name matching pattern */
 #endif
@@ -309,15 +376,18 @@ FRESULT f_write (FIL* fp, const void* buff, UINT btw, UINT* bw);	/* Write data t
 FRESULT f_lseek (FIL* fp, FSIZE_t ofs);								/* Move file pointer of the file object */
 FRESULT f_truncate (FIL* fp);										/* Truncate the file */
 FRESULT f_sync (FIL* fp);											/* Flush cached data of the writing file */
+FRESULT f_syncfs (const TCHAR* path, BYTE opt);						/* Flush the file syncs waiting on the volume */
 FRESULT f_opendir (DIR* dp, const TCHAR* path);						/* Open a directory */
 FRESULT f_closedir (DIR* dp);										/* Close an open directory */
 FRESULT f_readdir (DIR* dp, FILINFO* fno);							/* Read a directory item */
 FRESULT f_findfirst (DIR* dp, FILINFO* fno, const TCHAR* path, const TCHAR* pattern);	/* Find first file */
 FRESULT f_findnext (DIR* dp, FILINFO* fno);							/* Find next file */
 FRESULT f_mkdir (const TCHAR* path);								/* Create a sub directory */
+FRESULT f_mkpath (const TCHAR* path);								/* Create a sub directory and its missing parents */
 FRESULT f_unlink (const TCHAR* path);								/* Delete an existing file or directory */
 FRESULT f_rename (const TCHAR* path_old, const TCHAR* path_new);	/* Rename/Move a file or directory */
 FRESULT f_stat (const TCHAR* path, FILINFO* fno);					/* Get file status */
+FRESULT f_fstat (FIL* fp, FILINFO* fno);							/* Get status of an open file */
 FRESULT f_chmod (const TCHAR* path, BYTE attr, BYTE mask);			/* Change attribute of a file/dir */
 FRESULT f_utime (const TCHAR* path, const FILINFO* fno);			/* Change timestamp of a file/dir */
 FRESULT f_chdir (const TCHAR* path);								/* Change current directory */
@@ -133,7 +133,19 @@
 /  ff_memfree() exemplified in ffsystem.c, need to be added to the project. */
 
 
-#define FF_LFN_UNICODE	0
+#define FF_VOL_WORKBUF	1
+/* This option switches the LFN working buffers to persistent per-volume buffers
+/  when FF_USE_LFN == 3.
+/
+/   0: Allocate the working buffers from the heap on each API call.
+/   1: Use the buffers attached to the filesystem object by its owner before f_mount().
+/      lfnbuf (and dirbuf when exFAT is enabled) take FF_WORKBUF_SIZE bytes in total
+/      and zbuf is an optional zero filled buffer of zbsize bytes for clearing new
+/      directory tables, which can be shared by the volumes since it is only read.
+/      The API must not be re-entered on the same volume. */
+
+
+#define FF_LFN_UNICODE	2
 /* This option switches the character encoding on the API when LFN is enabled.
 /
 /   0: ANSI/OEM in current CP (TCHAR = char)
@@ -153,6 +165,17 @@
 /  on character encoding. When LFN is not enabled, these options have no effect. */
 
 
+#define FF_SFN_HASH		0
+/* This option selects the numeric tail of the SFN generated for an LFN which is
+/  out of 8.3 format.
+/
+/   0: ~1 to ~5 first, then tails hashed from the LFN (FatFs default).
+/   1: Tails hashed from the LFN only. Avoids piling up the sequential tails in
+/      directories holding many similar names.
+/
+/  Either way, free tails are found in a single scan of the directory. */
+
+
 #define FF_FS_RPATH		0
 /* This option configures support for relative path.
 /
@@ -263,6 +286,62 @@
 */
 
 
+#define FF_FS_SYNC_GROUP	32
+#define FF_FS_SYNC_TIME		4
+/* The option FF_FS_SYNC_GROUP switches group commit of file syncs. (0:Disable or >0:Enable)
+/  When enabled, f_sync() and f_close() update the directory entry in the window only
+/  and leave the volume flush (window write-back, FSInfo and CTRL_SYNC) to a later call.
+/  The flush is done on every FF_FS_SYNC_GROUP-th file sync, on the first file sync
+/  FF_FS_SYNC_TIME seconds or more after the oldest pending one, by any other function
+/  that syncs the volume and by f_syncfs(). A file closed in a group is on the medium
+/  only after that flush, so the application needs to call f_syncfs() before
+/  unmounting the volume. This option has no effect in read-only configuration. */
+
+
+#define FF_FS_FATWIN	1
+/* The option FF_FS_FATWIN switches separate sector windows for the FAT and the exFAT
+/  allocation bitmap. (0:Disable or 1:Enable)
+/  When enabled, the FAT and the bitmap are accessed through FATFS.fwin and FATFS.bwin
+/  with their own dirty flags, so following a cluster chain does not evict the
+/  directory sector in the common window and vice versa. The application sets the
+/  sector buffers before mounting the volume, a window without buffer falls back to
+/  the common window. */
+
+
+#define FF_FS_LAZY_FSINFO	1
+/* The option FF_FS_LAZY_FSINFO defers the allocation information, the FSInfo sector of
+/  FAT32 and the PercInUse field of exFAT. (0:Update on every sync or 1:Defer)
+/  When enabled, the first volume sync after a change of the allocation marks the
+/  information unknown and only f_syncfs() writes the actual values, so an interrupted
+/  session can not leave a wrong free cluster count behind. If FATFS.ibuf is set, it
+/  is used for these sectors instead of the window. */
+
+
+#define FF_FS_AU_SIZE	0x400000
+/* The option FF_FS_AU_SIZE switches allocation aligned to the allocation units (AU) of
+/  flash media. (0:Disable or AU size in bytes, a power of 2)
+/  The AU size used is the largest power of 2 up to this value the data area of the
+/  volume is aligned to, as SD formatters align it to the AU of the card. A volume
+/  whose data area is not aligned to more than one cluster is not affected.
+/  Once a file holds a quarter of an AU or more, it grows only into clusters of AUs
+/  it got started in or that were entirely free, and f_expand() places blocks of an AU
+/  or more at an AU boundary. Other files keep being packed from the last allocated
+/  cluster, so small files and large files do not share AUs. */
+
+
+#define FF_FS_RESERVE		0x100000
+#define FF_FS_RESERVE_FILES	8
+/* The option FF_FS_RESERVE switches cluster reservations for files being written.
+/  (0:Disable or reservation size in bytes)
+/  When enabled, a file that grows on f_write() reserves the clusters following each
+/  cluster allocated to it, up to FF_FS_RESERVE bytes ahead, and the other allocations
+/  pass over them as long as they find free clusters elsewhere. Files written at the
+/  same time so grow in runs instead of taking clusters in turns. The reservations
+/  are kept in memory only and are returned on f_close(). FF_FS_RESERVE_FILES is the
+/  number of files that can hold a reservation at the same time, a further file takes
+/  over the reservation of the least recent one. */
+
+
 #define FF_FS_LOCK		0
 /* The option FF_FS_LOCK switches file lock function to control duplicated file open
 /  and illegal operation to open objects. This option must be 0 when FF_FS_READONLY
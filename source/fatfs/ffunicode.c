@@ -15272,14 +15272,108 @@ WCHAR ff_oem2uni (	/* Returns Unicode character in UTF-16, zero on error */
 /*------------------------------------------------------------------------*/
 
 #if FF_CODE_PAGE >= 900
+
+/* Direct index over a sorted code pair table, built on the first lookup.
+/  pg[] maps the high byte of a code (the lead byte on the OEM side) to a page
+/  slot (1-based, zero if no pair in the page) and each slot holds the pair
+/  index at the 16 block boundaries of the page, so a lookup scans at most
+/  16 pairs instead of a binary search over the whole table. */
+
+#if FF_CODE_PAGE == 932
+#define CVIX_PG_U2O	98		/* Number of pages used by uni2oem932 */
+#define CVIX_PG_O2U	44		/* Number of pages used by oem2uni932 */
+#elif FF_CODE_PAGE == 936
+#define CVIX_PG_U2O	102
+#define CVIX_PG_O2U	127
+#elif FF_CODE_PAGE == 949
+#define CVIX_PG_U2O	145
+#define CVIX_PG_O2U	124
+#else
+#define CVIX_PG_U2O	97
+#define CVIX_PG_O2U	87
+#endif
+
+typedef struct {
+	BYTE pg[256];		/* Page slot for each high byte */
+	WORD (*blk)[17];	/* Pair index at each 16-code block boundary */
+	UINT npg;			/* Number of page slots in blk[] */
+	BYTE ready;			/* 0:Not built yet, 1:Built, 2:Does not fit (binary search) */
+} CVIX;
+
+static WORD cvix_blk_u2o[CVIX_PG_U2O][17];
+static WORD cvix_blk_o2u[CVIX_PG_O2U][17];
+static CVIX cvix_u2o = { {0}, cvix_blk_u2o, CVIX_PG_U2O, 0 };
+static CVIX cvix_o2u = { {0}, cvix_blk_o2u, CVIX_PG_O2U, 0 };
+
+
+static void cvix_build (
+	CVIX* ix,			/* Index to be built */
+	const WCHAR* p,		/* Code pair table */
+	UINT n				/* Number of pairs in the table */
+)
+{
+	UINT i = 0, hi, b, ns = 0;
+
+
+	while (i < n) {
+		hi = p[i * 2] >> 8;
+		if (ns == ix->npg) {	/* Index full (does not happen with the built-in data) */
+			for (hi = 0; hi < 256; hi++) ix->pg[hi] = 0;	/* Withdraw the pages published so far */
+			ix->ready = 2;		/* and stay with binary search */
+			return;
+		}
+		for (b = 0; b < 17; b++) {
+			while (i < n && p[i * 2] < (hi << 8) + (b << 4)) i++;
+			ix->blk[ns][b] = (WORD)i;
+		}
+		ix->pg[hi] = (BYTE)++ns;	/* Publish the page after it is filled */
+	}
+	ix->ready = 1;
+}
+
+
+static WCHAR cvix_find (	/* Returns the converted code, zero if not in the table */
+	CVIX* ix,			/* Index for the table */
+	const WCHAR* p,		/* Code pair table */
+	UINT n,				/* Number of pairs in the table */
+	WCHAR c				/* Code to be converted */
+)
+{
+	UINT i, e, s, li, hi;
+
+
+	if (!ix->ready) cvix_build(ix, p, n);
+	if (ix->ready == 1) {	/* Direct index */
+		s = ix->pg[c >> 8];
+		if (s == 0) return 0;
+		i = ix->blk[s - 1][(c >> 4) & 15];
+		e = ix->blk[s - 1][((c >> 4) & 15) + 1];
+		for ( ; i < e && p[i * 2] <= c; i++) {
+			if (p[i * 2] == c) return p[i * 2 + 1];
+		}
+		return 0;
+	}
+
+	li = 0; hi = n - 1;	/* Binary search */
+	for (e = 16; e; e--) {
+		i = li + (hi - li) / 2;
+		if (c == p[i * 2]) return p[i * 2 + 1];
+		if (c > p[i * 2]) {
+			li = i;
+		} else {
+			hi = i;
+		}
+	}
+	return 0;
+}
+
+
 WCHAR ff_uni2oem (	/* Returns OEM code character, zero on error */
 	DWORD	uni,	/* UTF-16 encoded character to be converted */
 	WORD	cp		/* Code page for the conversion */
 )
 {
-	const WCHAR* p;
-	WCHAR c = 0, uc;
-	UINT i = 0, n, li, hi;
+	WCHAR c = 0;
 
 
 	if (uni < 0x80) {	/* ASCII? */
@@ -15287,20 +15381,7 @@ WCHAR ff_uni2oem (	/* Returns OEM code character, zero on error */
 
 	} else {			/* Non-ASCII */
 		if (uni < 0x10000 && cp == FF_CODE_PAGE) {	/* Is it in BMP and valid code page? */
-			uc = (WCHAR)uni;
-			p = CVTBL(uni2oem, FF_CODE_PAGE);
-			hi = sizeof CVTBL(uni2oem, FF_CODE_PAGE) / 4 - 1;
-			li = 0;
-			for (n = 16; n; n--) {
-				i = li + (hi - li) / 2;
-				if (uc == p[i * 2]) break;
-				if (uc > p[i * 2]) {
-					li = i;
-				} else {
-					hi = i;
-				}
-			}
-			if (n != 0) c = p[i * 2 + 1];
+			c = cvix_find(&cvix_u2o, CVTBL(uni2oem, FF_CODE_PAGE), sizeof CVTBL(uni2oem, FF_CODE_PAGE) / 4, (WCHAR)uni);
 		}
 	}
 
@@ -15313,9 +15394,7 @@ WCHAR ff_oem2uni (	/* Returns Unicode character in UTF-16, zero on error */
 	WORD	cp		/* Code page for the conversion */
 )
 {
-	const WCHAR* p;
 	WCHAR c = 0;
-	UINT i = 0, n, li, hi;
 
 
 	if (oem < 0x80) {	/* ASCII? */
@@ -15323,19 +15402,7 @@ WCHAR ff_oem2uni (	/* Returns Unicode character in UTF-16, zero on error */
 
 	} else {			/* Extended char */
 		if (cp == FF_CODE_PAGE) {	/* Is it valid code page? */
-			p = CVTBL(oem2uni, FF_CODE_PAGE);
-			hi = sizeof CVTBL(oem2uni, FF_CODE_PAGE) / 4 - 1;
-			li = 0;
-			for (n = 16; n; n--) {
-				i = li + (hi - li) / 2;
-				if (oem == p[i * 2]) break;
-				if (oem > p[i * 2]) {
-					li = i;
-				} else {
-					hi = i;
-				}
-			}
-			if (n != 0) c = p[i * 2 + 1];
+			c = cvix_find(&cvix_o2u, CVTBL(oem2uni, FF_CODE_PAGE), sizeof CVTBL(oem2uni, FF_CODE_PAGE) / 4, oem);
 		}
 	}
 
@@ -15461,129 +15528,176 @@ WCHAR ff_oem2uni (	/* Returns Unicode character in UTF-16, zero on error */
 /* Unicode Up-case Conversion                                             */
 /*------------------------------------------------------------------------*/
 
-DWORD ff_wtoupper (	/* Returns up-converted code point */
-	DWORD uni		/* Unicode code point to be up-converted */
+static const WORD cvt1[] = {	/* Compressed up conversion table for U+0000 - U+0FFF */
+	/* Basic Latin */
+	0x0061,0x031A,
+	/* Latin-1 Supplement */
+	0x00E0,0x0317,
+	0x00F8,0x0307,
+	0x00FF,0x0001,0x0178,
+	/* Latin Extended-A */
+	0x0100,0x0130,
+	0x0132,0x0106,
+	0x0139,0x0110,
+	0x014A,0x012E,
+	0x0179,0x0106,
+	/* Latin Extended-B */
+	0x0180,0x004D,0x0243,0x0181,0x0182,0x0182,0x0184,0x0184,0x0186,0x0187,0x0187,0x0189,0x018A,0x018B,0x018B,0x018D,0x018E,0x018F,0x0190,0x0191,0x0191,0x0193,0x0194,0x01F6,0x0196,0x0197,0x0198,0x0198,0x023D,0x019B,0x019C,0x019D,0x0220,0x019F,0x01A0,0x01A0,0x01A2,0x01A2,0x01A4,0x01A4,0x01A6,0x01A7,0x01A7,0x01A9,0x01AA,0x01AB,0x01AC,0x01AC,0x01AE,0x01AF,0x01AF,0x01B1,0x01B2,0x01B3,0x01B3,0x01B5,0x01B5,0x01B7,0x01B8,0x01B8,0x01BA,0x01BB,0x01BC,0x01BC,0x01BE,0x01F7,0x01C0,0x01C1,0x01C2,0x01C3,0x01C4,0x01C5,0x01C4,0x01C7,0x01C8,0x01C7,0x01CA,0x01CB,0x01CA,
+	0x01CD,0x0110,
+	0x01DD,0x0001,0x018E,
+	0x01DE,0x0112,
+	0x01F3,0x0003,0x01F1,0x01F4,0x01F4,
+	0x01F8,0x0128,
+	0x0222,0x0112,
+	0x023A,0x0009,0x2C65,0x023B,0x023B,0x023D,0x2C66,0x023F,0x0240,0x0241,0x0241,
+	0x0246,0x010A,
+	/* IPA Extensions */
+	0x0253,0x0040,0x0181,0x0186,0x0255,0x0189,0x018A,0x0258,0x018F,0x025A,0x0190,0x025C,0x025D,0x025E,0x025F,0x0193,0x0261,0x0262,0x0194,0x0264,0x0265,0x0266,0x0267,0x0197,0x0196,0x026A,0x2C62,0x026C,0x026D,0x026E,0x019C,0x0270,0x0271,0x019D,0x0273,0x0274,0x019F,0x0276,0x0277,0x0278,0x0279,0x027A,0x027B,0x027C,0x2C64,0x027E,0x027F,0x01A6,0x0281,0x0282,0x01A9,0x0284,0x0285,0x0286,0x0287,0x01AE,0x0244,0x01B1,0x01B2,0x0245,0x028D,0x028E,0x028F,0x0290,0x0291,0x01B7,
+	/* Greek, Coptic */
+	0x037B,0x0003,0x03FD,0x03FE,0x03FF,
+	0x03AC,0x0004,0x0386,0x0388,0x0389,0x038A,
+	0x03B1,0x0311,
+	0x03C2,0x0002,0x03A3,0x03A3,
+	0x03C4,0x0308,
+	0x03CC,0x0003,0x038C,0x038E,0x038F,
+	0x03D8,0x0118,
+	0x03F2,0x000A,0x03F9,0x03F3,0x03F4,0x03F5,0x03F6,0x03F7,0x03F7,0x03F9,0x03FA,0x03FA,
+	/* Cyrillic */
+	0x0430,0x0320,
+	0x0450,0x0710,
+	0x0460,0x0122,
+	0x048A,0x0136,
+	0x04C1,0x010E,
+	0x04CF,0x0001,0x04C0,
+	0x04D0,0x0144,
+	/* Armenian */
+	0x0561,0x0426,
+
+	0x0000	/* EOT */
+};
+static const WORD cvt2[] = {	/* Compressed up conversion table for U+1000 - U+FFFF */
+	/* Phonetic Extensions */
+	0x1D7D,0x0001,0x2C63,
+	/* Latin Extended Additional */
+	0x1E00,0x0196,
+	0x1EA0,0x015A,
+	/* Greek Extended */
+	0x1F00,0x0608,
+	0x1F10,0x0606,
+	0x1F20,0x0608,
+	0x1F30,0x0608,
+	0x1F40,0x0606,
+	0x1F51,0x0007,0x1F59,0x1F52,0x1F5B,0x1F54,0x1F5D,0x1F56,0x1F5F,
+	0x1F60,0x0608,
+	0x1F70,0x000E,0x1FBA,0x1FBB,0x1FC8,0x1FC9,0x1FCA,0x1FCB,0x1FDA,0x1FDB,0x1FF8,0x1FF9,0x1FEA,0x1FEB,0x1FFA,0x1FFB,
+	0x1F80,0x0608,
+	0x1F90,0x0608,
+	0x1FA0,0x0608,
+	0x1FB0,0x0004,0x1FB8,0x1FB9,0x1FB2,0x1FBC,
+	0x1FCC,0x0001,0x1FC3,
+	0x1FD0,0x0602,
+	0x1FE0,0x0602,
+	0x1FE5,0x0001,0x1FEC,
+	0x1FF3,0x0001,0x1FFC,
+	/* Letterlike Symbols */
+	0x214E,0x0001,0x2132,
+	/* Number forms */
+	0x2170,0x0210,
+	0x2184,0x0001,0x2183,
+	/* Enclosed Alphanumerics */
+	0x24D0,0x051A,
+	0x2C30,0x042F,
+	/* Latin Extended-C */
+	0x2C60,0x0102,
+	0x2C67,0x0106, 0x2C75,0x0102,
+	/* Coptic */
+	0x2C80,0x0164,
+	/* Georgian Supplement */
+	0x2D00,0x0826,
+	/* Full-width */
+	0xFF41,0x031A,
+
+	0x0000	/* EOT */
+};
+
+
+
+static WORD wtoupper_cvt (	/* Returns up-converted code (walks the compressed table) */
+	WORD uc		/* BMP code point to be up-converted */
 )
 {
 	const WORD* p;
-	WORD uc, bc, nc, cmd;
-	static const WORD cvt1[] = {	/* Compressed up conversion table for U+0000 - U+0FFF */
-		/* Basic Latin */
-		0x0061,0x031A,
-		/* Latin-1 Supplement */
-		0x00E0,0x0317,
-		0x00F8,0x0307,
-		0x00FF,0x0001,0x0178,
-		/* Latin Extended-A */
-		0x0100,0x0130,
-		0x0132,0x0106,
-		0x0139,0x0110,
-		0x014A,0x012E,
-		0x0179,0x0106,
-		/* Latin Extended-B */
-		0x0180,0x004D,0x0243,0x0181,0x0182,0x0182,0x0184,0x0184,0x0186,0x0187,0x0187,0x0189,0x018A,0x018B,0x018B,0x018D,0x018E,0x018F,0x0190,0x0191,0x0191,0x0193,0x0194,0x01F6,0x0196,0x0197,0x0198,0x0198,0x023D,0x019B,0x019C,0x019D,0x0220,0x019F,0x01A0,0x01A0,0x01A2,0x01A2,0x01A4,0x01A4,0x01A6,0x01A7,0x01A7,0x01A9,0x01AA,0x01AB,0x01AC,0x01AC,0x01AE,0x01AF,0x01AF,0x01B1,0x01B2,0x01B3,0x01B3,0x01B5,0x01B5,0x01B7,0x01B8,0x01B8,0x01BA,0x01BB,0x01BC,0x01BC,0x01BE,0x01F7,0x01C0,0x01C1,0x01C2,0x01C3,0x01C4,0x01C5,0x01C4,0x01C7,0x01C8,0x01C7,0x01CA,0x01CB,0x01CA,
-		0x01CD,0x0110,
-		0x01DD,0x0001,0x018E,
-		0x01DE,0x0112,
-		0x01F3,0x0003,0x01F1,0x01F4,0x01F4,
-		0x01F8,0x0128,
-		0x0222,0x0112,
-		0x023A,0x0009,0x2C65,0x023B,0x023B,0x023D,0x2C66,0x023F,0x0240,0x0241,0x0241,
-		0x0246,0x010A,
-		/* IPA Extensions */
-		0x0253,0x0040,0x0181,0x0186,0x0255,0x0189,0x018A,0x0258,0x018F,0x025A,0x0190,0x025C,0x025D,0x025E,0x025F,0x0193,0x0261,0x0262,0x0194,0x0264,0x0265,0x0266,0x0267,0x0197,0x0196,0x026A,0x2C62,0x026C,0x026D,0x026E,0x019C,0x0270,0x0271,0x019D,0x0273,0x0274,0x019F,0x0276,0x0277,0x0278,0x0279,0x027A,0x027B,0x027C,0x2C64,0x027E,0x027F,0x01A6,0x0281,0x0282,0x01A9,0x0284,0x0285,0x0286,0x0287,0x01AE,0x0244,0x01B1,0x01B2,0x0245,0x028D,0x028E,0x028F,0x0290,0x0291,0x01B7,
-		/* Greek, Coptic */
-		0x037B,0x0003,0x03FD,0x03FE,0x03FF,
-		0x03AC,0x0004,0x0386,0x0388,0x0389,0x038A,
-		0x03B1,0x0311,
-		0x03C2,0x0002,0x03A3,0x03A3,
-		0x03C4,0x0308,
-		0x03CC,0x0003,0x038C,0x038E,0x038F,
-		0x03D8,0x0118,
-		0x03F2,0x000A,0x03F9,0x03F3,0x03F4,0x03F5,0x03F6,0x03F7,0x03F7,0x03F9,0x03FA,0x03FA,
-		/* Cyrillic */
-		0x0430,0x0320,
-		0x0450,0x0710,
-		0x0460,0x0122,
-		0x048A,0x0136,
-		0x04C1,0x010E,
-		0x04CF,0x0001,0x04C0,
-		0x04D0,0x0144,
-		/* Armenian */
-		0x0561,0x0426,
+	WORD bc, nc, cmd;
+
+
+	p = uc < 0x1000 ? cvt1 : cvt2;
+	for (;;) {
+		bc = *p++;								/* Get the block base */
+		if (bc == 0 || uc < bc) break;			/* Not matched? */
+		nc = *p++; cmd = nc >> 8; nc &= 0xFF;	/* Get processing command and block size */
+		if (uc < bc + nc) {	/* In the block? */
+			switch (cmd) {
+			case 0:	uc = p[uc - bc]; break;		/* Table conversion */
+			case 1:	uc -= (uc - bc) & 1; break;	/* Case pairs */
+			case 2: uc -= 16; break;			/* Shift -16 */
+			case 3:	uc -= 32; break;			/* Shift -32 */
+			case 4:	uc -= 48; break;			/* Shift -48 */
+			case 5:	uc -= 26; break;			/* Shift -26 */
+			case 6:	uc += 8; break;				/* Shift +8 */
+			case 7: uc -= 80; break;			/* Shift -80 */
+			case 8:	uc -= 0x1C60; break;		/* Shift -0x1C60 */
+			}
+			break;
+		}
+		if (cmd == 0) p += nc;	/* Skip table if needed */
+	}
+	return uc;
+}
+
+
+/* Flat two-level up-case table expanded from cvt1/cvt2 on the first call.
+/  upct_idx[] maps the high byte of a BMP code point to a 256-entry page in
+/  upct[] (1-based), zero for the pages without any case conversion. */
 
-		0x0000	/* EOT */
-	};
-	static const WORD cvt2[] = {	/* Compressed up conversion table for U+1000 - U+FFFF */
-		/* Phonetic Extensions */
-		0x1D7D,0x0001,0x2C63,
-		/* Latin Extended Additional */
-		0x1E00,0x0196,
-		0x1EA0,0x015A,
-		/* Greek Extended */
-		0x1F00,0x0608,
-		0x1F10,0x0606,
-		0x1F20,0x0608,
-		0x1F30,0x0608,
-		0x1F40,0x0606,
-		0x1F51,0x0007,0x1F59,0x1F52,0x1F5B,0x1F54,0x1F5D,0x1F56,0x1F5F,
-		0x1F60,0x0608,
-		0x1F70,0x000E,0x1FBA,0x1FBB,0x1FC8,0x1FC9,0x1FCA,0x1FCB,0x1FDA,0x1FDB,0x1FF8,0x1FF9,0x1FEA,0x1FEB,0x1FFA,0x1FFB,
-		0x1F80,0x0608,
-		0x1F90,0x0608,
-		0x1FA0,0x0608,
-		0x1FB0,0x0004,0x1FB8,0x1FB9,0x1FB2,0x1FBC,
-		0x1FCC,0x0001,0x1FC3,
-		0x1FD0,0x0602,
-		0x1FE0,0x0602,
-		0x1FE5,0x0001,0x1FEC,
-		0x1FF3,0x0001,0x1FFC,
-		/* Letterlike Symbols */
-		0x214E,0x0001,0x2132,
-		/* Number forms */
-		0x2170,0x0210,
-		0x2184,0x0001,0x2183,
-		/* Enclosed Alphanumerics */
-		0x24D0,0x051A,
-		0x2C30,0x042F,
-		/* Latin Extended-C */
-		0x2C60,0x0102,
-		0x2C67,0x0106, 0x2C75,0x0102,
-		/* Coptic */
-		0x2C80,0x0164,
-		/* Georgian Supplement */
-		0x2D00,0x0826,
-		/* Full-width */
-		0xFF41,0x031A,
+#define UPCT_PAGES	16	/* Number of pages with conversions in cvt1/cvt2 is 14 */
 
-		0x0000	/* EOT */
-	};
+static BYTE upct_idx[256];
+static WCHAR upct[UPCT_PAGES][256];
+static BYTE upct_ready;
 
 
+static void upct_build (void)
+{
+	UINT hi, lo, np = 0;
+	WCHAR *pg;
+
+
+	for (hi = 0; hi < 256; hi++) {
+		for (lo = 0; lo < 256 && wtoupper_cvt((WORD)(hi << 8 | lo)) == (WORD)(hi << 8 | lo); lo++) ;
+		if (lo == 256) continue;	/* Page has no conversion */
+		if (np == UPCT_PAGES) break;	/* Table full (does not happen with the built-in data) */
+		pg = upct[np++];
+		for (lo = 0; lo < 256; lo++) pg[lo] = wtoupper_cvt((WORD)(hi << 8 | lo));
+		upct_idx[hi] = (BYTE)np;	/* Publish the page after it is filled */
+	}
+	upct_ready = 1;
+}
+
+
+DWORD ff_wtoupper (	/* Returns up-converted code point */
+	DWORD uni		/* Unicode code point to be up-converted */
+)
+{
+	UINT pi;
+
+
+	if (uni < 0x80) {	/* ASCII? */
+		return (uni >= 'a' && uni <= 'z') ? uni - 0x20 : uni;
+	}
 	if (uni < 0x10000) {	/* Is it in BMP? */
-		uc = (WORD)uni;
-		p = uc < 0x1000 ? cvt1 : cvt2;
-		for (;;) {
-			bc = *p++;								/* Get the block base */
-			if (bc == 0 || uc < bc) break;			/* Not matched? */
-			nc = *p++; cmd = nc >> 8; nc &= 0xFF;	/* Get processing command and block size */
-			if (uc < bc + nc) {	/* In the block? */
-				switch (cmd) {
-				case 0:	uc = p[uc - bc]; break;		/* Table conversion */
-				case 1:	uc -= (uc - bc) & 1; break;	/* Case pairs */
-				case 2: uc -= 16; break;			/* Shift -16 */
-				case 3:	uc -= 32; break;			/* Shift -32 */
-				case 4:	uc -= 48; break;			/* Shift -48 */
-				case 5:	uc -= 26; break;			/* Shift -26 */
-				case 6:	uc += 8; break;				/* Shift +8 */
-				case 7: uc -= 80; break;			/* Shift -80 */
-				case 8:	uc -= 0x1C60; break;		/* Shift -0x1C60 */
-				}
-				break;
-			}
-			if (cmd == 0) p += nc;	/* Skip table if needed */
-		}
-		uni = uc;
+		if (!upct_ready) upct_build();
+		pi = upct_idx[uni >> 8];
+		if (pi != 0) uni = upct[pi - 1][uni & 0xFF];
 	}
 
 	return uni;
@@ -285,6 +285,16 @@ typedef struct FAT_ReadDirRequest {
     FSDirectoryEntry *entry;
 } FAT_ReadDirRequest;
 
+/* wafel_fatfs extension, never sent by IOS-FS itself: fills up to count
+   entries in one message and returns the number of entries read */
+#define FAT_COMMAND_READ_DIR_MULTI 0x80
+
+typedef struct FAT_ReadDirMultiRequest {
+    void **dp;
+    FSDirectoryEntry *entries;
+    uint count;
+} FAT_ReadDirMultiRequest;
+
 struct FAT_BaseRequest {
     char unknown[1028];
 };
@@ -380,6 +390,7 @@ union FAT_Request {
     struct FAT_BaseRequest _b; /* fake to pad struct */
     FAT_OpenDirRequest open_dir;
     FAT_ReadDirRequest read_dir;
+    FAT_ReadDirMultiRequest read_dir_multi;
     FAT_CloseDirRequst close_dir;
     FAT_OpenFileRequest open_file;
     FAT_ReadFileRequest read_file;
@@ -3,11 +3,11 @@
 #include "fatfs/ff.h"
 #include <wafel/utils.h>
 #include <wafel/ios/memory.h>
+#include <wafel/ios/svc.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
-#include <time.h>
 
 static const char* MODULE_NAME = "SALFATFS";
 
@@ -28,17 +28,66 @@ static struct mounts {
     FATFS *fs;
     bool mounted;
     int mount_count;
+    uint8_t cluster_shift; // log2 of the cluster size in bytes, 0 until the volume got accessed
+    uint win_size; // sector size of the device the sector buffers of fs were allocated for
+    volatile bool reattached; // set by the attach path, the worker drops the volume
+    volatile uint reattach_handle; // device handle to use from then on
 
 } fatfs_mounts[FF_VOLUMES] = {};
 
+// buffer window for handles opened for reading and writing
+#define RECORD_BUFFER_SIZE 0x1000
+
+// Memory of the plugin besides the handles, all of it bounded:
+// - salio page cache: SALIO_PAGES * SALIO_PAGE_SIZE = 64 KB, static
+// - zero buffer: ZERO_BUFFER_SIZE = 16 KB on the first mount, new directories are cleared
+//   through the volume window without it
+// - per volume: FATFS_SECTOR_BUFFERS sectors plus FF_WORKBUF_SIZE (about 3 KB on SD cards)
+// - file cache: at most FILE_CACHE_SIZE = 256 KB, allocated per file when it gets filled.
+//   Reads go to the file when the allocation fails.
+// In total about 340 KB at most on top of the open handles.
+
+// RAM cache for small files that get opened again and again (config, icons, meta.xml)
+#define FILE_CACHE_MAX_FILE 0x14000 // largest file kept, just above an icon texture
+#define FILE_CACHE_SIZE 0x40000 // memory for all cached files, the upper bound, not reserved
+#define FILE_CACHE_ENTRIES 32
+
+typedef struct file_cache_entry {
+    FATFS *fs;      // volume
+    DWORD sclust;   // start cluster, identifies the file on the volume
+    FSIZE_t size;
+    WORD fdate, ftime;
+    bool valid;     // cleared when the file got written, the data stays until the last reader is done
+    uint refs;      // handles reading from data
+    uint last_use;
+    BYTE *data;     // NULL for a free slot
+} file_cache_entry;
+
+// Memory per open handle: a PathFIL is about 100 bytes plus a sector sized buffer (512 bytes on
+// SD cards, up to 4 KB on large sector drives, RECORD_BUFFER_SIZE for read/write handles), a
+// PathDIR about 100 bytes. Besides the debug output, only read only handles keep their path,
+// in a buffer of the path's length that stays with the pooled handle.
 typedef struct PathFIL {
     FIL fil;
+    uint buf_size;
+    bool cache_check;         // read only handle of a small file, look it up on the next read
+    bool cache_missed;        // a read missed the cache already, the next one fills it
+    file_cache_entry *cache;  // reads are served from here while set
+    FSIZE_t cache_pos;        // position while reading from the cache
+    uint64_t path_hash;       // read only handles, key for reopening after close
+    char *park_path;          // read only handles, the path the key stands for
+    uint park_path_size;
+#ifdef FATFS_DEBUG
     char path[512+4];
+#endif
 } PathFIL;
 
 typedef struct PathDIR {
     DIR dir;
+    FRESULT pending;          // error hit after a partial multi read, returned by the next read
+#ifdef FATFS_DEBUG
     char path[512+4];
+#endif
 } PathDIR;
 
 int salfatfs_find_index(uint volume_handle){
@@ -49,66 +98,443 @@ int salfatfs_find_index(uint volume_handle){
     return -1;
 }
 
-int salfatfs_add_volume(uint volume_handle, uint dev_handle){
-    int index = salfatfs_find_index(volume_handle);
-    if(index>=0){
-        fatfs_mounts[index].mounted = false;
-        salio_set_dev_handle(index, dev_handle);
-        return index;
-    }
+// zero filled buffer for clearing new directory tables, shared by the volumes since it is only read
+#define ZERO_BUFFER_SIZE 0x4000
+static BYTE *zero_buffer;
 
-    for(index=0; index<FF_VOLUMES; index++){
-        if(!fatfs_mounts[index].used){
-            fatfs_mounts[index].used = true;
-            fatfs_mounts[index].volume_handle = volume_handle;
-            fatfs_mounts[index].mounted = false;
-            salio_set_dev_handle(index, dev_handle);
-            return index;
-        }
-    }
-    return -1;
+// One aligned block for the sector buffers of a volume: the window for directories, the FAT
+// and exFAT bitmap windows, so walking a chain does not evict the directory sector, and the
+// FSInfo/VBR sector so that updating it does not evict the window either.
+#define FATFS_SECTOR_BUFFERS 4
+
+static bool ff_allocate_sectors(FATFS *fs, uint sector_size){
+    BYTE *sectors = iosAllocAligned(HEAPID_LOCAL, sector_size * FATFS_SECTOR_BUFFERS, SALIO_ALIGNMENT);
+    if(!sectors)
+        return false;
+    fs->win = sectors;
+    fs->fwin.buf = sectors + sector_size;
+    fs->bwin.buf = sectors + sector_size * 2;
+    fs->ibuf = sectors + sector_size * 3;
+    return true;
 }
 
-FATFS* ff_allocate_FATFS(void){
+FATFS* ff_allocate_FATFS(uint sector_size){
+    if(!zero_buffer){
+        zero_buffer = iosAllocAligned(HEAPID_LOCAL, ZERO_BUFFER_SIZE, SALIO_ALIGNMENT);
+        if(zero_buffer)
+            memset(zero_buffer, 0, ZERO_BUFFER_SIZE);
+    }
     FATFS *fs = malloc_local(sizeof(FATFS));
     if(!fs)
         return fs;
-    fs->win = iosAllocAligned(HEAPID_LOCAL, FF_MAX_SS, SALIO_ALIGNMENT);
-    if(!fs->win){
+    if(!ff_allocate_sectors(fs, sector_size)){
+        free_local(fs);
+        return NULL;
+    }
+    // persistent LFN working buffers, only one message is processed at a time
+    fs->lfnbuf = malloc_local(FF_WORKBUF_SIZE);
+    if(!fs->lfnbuf){
+        free_local(fs->win);
         free_local(fs);
         return NULL;
     }
+    fs->dirbuf = (BYTE*)(fs->lfnbuf + FF_MAX_LFN + 1);
+    // without the zero buffer new directories are cleared through the window
+    fs->zbuf = zero_buffer;
+    fs->zbsize = zero_buffer ? ZERO_BUFFER_SIZE : 0;
     return fs;
 }
 
 void ff_free_FATFS(FATFS *fs){
+    free_local(fs->lfnbuf);
     free_local(fs->win);
     free_local(fs);
 }
 
-PathFIL* ff_allocate_FIL(void){
-    PathFIL *fp = malloc_local(sizeof(PathFIL));
-    if(!fp)
-        return fp;
-    fp->fil.buf = iosAllocAligned(HEAPID_LOCAL, FF_MAX_SS, SALIO_ALIGNMENT);
-    if(!fp->fil.buf){
-        free_local(fp);
-        return NULL;
+// Closed handles go to a free list instead of back to the heap. A pooled PathFIL keeps its
+// aligned sector buffer, so once the pools reached their high water mark open/close does no
+// heap calls. The items are linked through their first word, which FatFs does not need
+// while the handle is closed.
+typedef struct pool_item {
+    struct pool_item *next;
+} pool_item;
+
+typedef struct handle_pool {
+    const char *name;
+    pool_item *free;
+    uint used;
+    uint high_water;
+} handle_pool;
+
+static handle_pool fil_pool = { "FIL" };
+static handle_pool dir_pool = { "DIR" };
+
+static void* pool_take(handle_pool *pool){
+    pool_item *item = pool->free;
+    if(item)
+        pool->free = item->next;
+    return item;
+}
+
+static void pool_count(handle_pool *pool){
+    if(++pool->used > pool->high_water){
+        pool->high_water = pool->used;
+        DPRINTF(3, ("%s: %s pool high water: %u\n", MODULE_NAME, pool->name, pool->high_water));
+    }
+}
+
+static void pool_put(handle_pool *pool, void *obj){
+    pool_item *item = obj;
+    item->next = pool->free;
+    pool->free = item;
+}
+
+static void pool_release(handle_pool *pool, void *obj){
+    pool->used--;
+    pool_put(pool, obj);
+}
+
+PathFIL* ff_allocate_FIL(uint sector_size){
+    PathFIL *fp = pool_take(&fil_pool);
+    if(!fp){
+        fp = malloc_local(sizeof(PathFIL));
+        if(!fp)
+            return fp;
+        fp->buf_size = 0;
+        fp->park_path_size = 0;
     }
+    if(fp->buf_size < sector_size){
+        // new item or pooled from a volume with smaller sectors
+        BYTE *buf = iosAllocAligned(HEAPID_LOCAL, sector_size, SALIO_ALIGNMENT);
+        if(!buf){
+            // keep the item with its old buffer for the next open
+            pool_put(&fil_pool, fp);
+            return NULL;
+        }
+        if(fp->buf_size)
+            free_local(fp->fil.buf);
+        fp->fil.buf = buf;
+        fp->buf_size = sector_size;
+    }
+    pool_count(&fil_pool);
     return fp;
 }
 
 void ff_free_FIL(PathFIL *fp){
-    free_local(fp->fil.buf);
-    free_local(fp);
+    pool_release(&fil_pool, fp);
 }
 
 PathDIR* ff_allocate_DIR(void){
-    return malloc_local(sizeof(PathDIR));
+    PathDIR *dp = pool_take(&dir_pool);
+    if(!dp){
+        dp = malloc_local(sizeof(PathDIR));
+        if(!dp)
+            return dp;
+    }
+    pool_count(&dir_pool);
+    return dp;
 }
 
 void ff_free_DIR(PathDIR *dp){
-    free_local(dp);
+    pool_release(&dir_pool, dp);
+}
+
+// Cached files are matched by volume, start cluster, size and modification time. Writes
+// through this driver drop the entries of the written file, everything of a volume is
+// dropped on unmount.
+static file_cache_entry file_cache[FILE_CACHE_ENTRIES];
+static uint file_cache_bytes;
+static uint file_cache_clock;
+static struct {
+    uint lookups;
+    uint hits;
+    uint64_t filled;  // bytes read from the device into the cache
+    uint64_t served;  // bytes copied out of the cache
+} file_cache_stats;
+
+static void file_cache_report(void){
+    DPRINTF(3, ("%s: file cache: %u/%u hits, %llu bytes saved, %u bytes used\n", MODULE_NAME,
+            file_cache_stats.hits, file_cache_stats.lookups,
+            file_cache_stats.served > file_cache_stats.filled ? file_cache_stats.served - file_cache_stats.filled : 0,
+            file_cache_bytes));
+}
+
+static void file_cache_free(file_cache_entry *entry){
+    file_cache_bytes -= entry->size;
+    free_local(entry->data);
+    entry->data = NULL;
+}
+
+static void file_cache_drop(file_cache_entry *entry){
+    entry->valid = false;
+    if(!entry->refs)
+        file_cache_free(entry);
+}
+
+// the file got written, readers still using the entry switch back to the file
+static void file_cache_invalidate(FATFS *fs, DWORD sclust){
+    if(!file_cache_bytes || !sclust)
+        return;
+    for(int i=0; i<FILE_CACHE_ENTRIES; i++){
+        file_cache_entry *entry = file_cache + i;
+        if(entry->data && entry->valid && entry->fs == fs && entry->sclust == sclust)
+            file_cache_drop(entry);
+    }
+}
+
+static void file_cache_invalidate_volume(FATFS *fs){
+    for(int i=0; i<FILE_CACHE_ENTRIES; i++){
+        file_cache_entry *entry = file_cache + i;
+        if(entry->data && entry->valid && entry->fs == fs)
+            file_cache_drop(entry);
+    }
+    file_cache_report();
+}
+
+static void file_cache_release(file_cache_entry *entry){
+    if(--entry->refs == 0 && !entry->valid)
+        file_cache_free(entry);
+}
+
+// finds a slot with room for size bytes, evicting the least recently used unreferenced files
+static file_cache_entry* file_cache_slot(FSIZE_t size){
+    for(;;){
+        file_cache_entry *free_slot = NULL, *lru = NULL;
+        for(int i=0; i<FILE_CACHE_ENTRIES; i++){
+            file_cache_entry *entry = file_cache + i;
+            if(!entry->data){
+                if(!free_slot)
+                    free_slot = entry;
+            } else if(!entry->refs && (!lru || entry->last_use < lru->last_use)){
+                lru = entry;
+            }
+        }
+        if(free_slot && file_cache_bytes + size <= FILE_CACHE_SIZE)
+            return free_slot;
+        if(!lru)
+            return NULL;
+        file_cache_drop(lru);
+    }
+}
+
+// Reads on a cacheable handle: use the cached file if there is one. The file is only read
+// into the cache when the read takes all of it anyway, or on the second read of the handle,
+// so a single small read (a header, a version field) does not read the whole file.
+static void file_cache_attach(PathFIL *fp, FSIZE_t read_pos, FSIZE_t read_size){
+    fp->cache_check = false;
+    FILINFO info;
+    if(f_fstat(&fp->fil, &info) != FR_OK)
+        return;
+    FATFS *fs = fp->fil.obj.fs;
+    DWORD sclust = fp->fil.obj.sclust;
+    FSIZE_t size = f_size(&fp->fil);
+    FSIZE_t pos = f_tell(&fp->fil);
+
+    file_cache_stats.lookups++;
+    if((file_cache_stats.lookups & 63) == 0)
+        file_cache_report();
+    for(int i=0; i<FILE_CACHE_ENTRIES; i++){
+        file_cache_entry *entry = file_cache + i;
+        if(entry->data && entry->valid && entry->fs == fs && entry->sclust == sclust && entry->size == size
+                && entry->fdate == info.fdate && entry->ftime == info.ftime){
+            file_cache_stats.hits++;
+            entry->refs++;
+            entry->last_use = ++file_cache_clock;
+            fp->cache = entry;
+            fp->cache_pos = pos;
+            return;
+        }
+    }
+
+    if(!fp->cache_missed && (read_pos || read_size < size)){
+        fp->cache_missed = true;
+        fp->cache_check = true;
+        return;
+    }
+    file_cache_entry *entry = file_cache_slot(size);
+    if(!entry)
+        return;
+    // aligned, the fill goes straight from the device into the cache
+    BYTE *data = iosAllocAligned(HEAPID_LOCAL, size, SALIO_ALIGNMENT);
+    if(!data)
+        return;
+    UINT br;
+    if((pos && f_lseek(&fp->fil, 0) != FR_OK) || f_read(&fp->fil, data, size, &br) != FR_OK || br != size){
+        free_local(data);
+        f_lseek(&fp->fil, pos);
+        return;
+    }
+    file_cache_stats.filled += size;
+    entry->fs = fs;
+    entry->sclust = sclust;
+    entry->size = size;
+    entry->fdate = info.fdate;
+    entry->ftime = info.ftime;
+    entry->valid = true;
+    entry->refs = 1;
+    entry->last_use = ++file_cache_clock;
+    entry->data = data;
+    file_cache_bytes += size;
+    fp->cache = entry;
+    fp->cache_pos = pos;
+}
+
+// stop reading from the cache, the file position continues where the cache left off
+static FRESULT file_cache_detach(PathFIL *fp){
+    file_cache_release(fp->cache);
+    fp->cache = NULL;
+    return f_lseek(&fp->fil, fp->cache_pos);
+}
+
+// Closed read only handles stay open in FatFs for a while. Opening the same path again
+// revives the handle with its cluster and buffer state, without walking the path. The
+// 64 bit hash of the full path finds the candidates, the stored path decides. A handle
+// that wrote, extended or closed a file drops the parked handles of that file, they
+// would still see the old size and cluster chain.
+#define PARKED_FILES 8
+
+static struct parked_file {
+    PathFIL *fp; // NULL for a free slot
+    uint last_use;
+} parked_files[PARKED_FILES];
+static uint parked_clock;
+
+static uint64_t path_hash(const char *path){
+    uint64_t hash = 0xcbf29ce484222325ULL; // FNV-1a
+    while(*path){
+        hash ^= (BYTE)*path++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// keeps the path of a read only handle, false when there is no memory for it
+static bool park_set_path(PathFIL *fp, const char *path){
+    uint len = strlen(path) + 1;
+    if(fp->park_path_size < len){
+        uint size = (len + 63) & ~63;
+        char *buf = malloc_local(size);
+        if(!buf)
+            return false;
+        if(fp->park_path_size)
+            free_local(fp->park_path);
+        fp->park_path = buf;
+        fp->park_path_size = size;
+    }
+    memcpy(fp->park_path, path, len);
+    return true;
+}
+
+static void park_close(struct parked_file *pf){
+    f_close(&pf->fp->fil);
+    ff_free_FIL(pf->fp);
+    pf->fp = NULL;
+}
+
+static void park_put(PathFIL *fp){
+    struct parked_file *pf = parked_files;
+    for(int i=1; i<PARKED_FILES && pf->fp; i++){
+        if(!parked_files[i].fp || parked_files[i].last_use < pf->last_use)
+            pf = parked_files + i;
+    }
+    if(pf->fp)
+        park_close(pf);
+    pf->fp = fp;
+    pf->last_use = ++parked_clock;
+}
+
+static PathFIL* park_take(uint64_t hash, const char *path){
+    for(int i=0; i<PARKED_FILES; i++){
+        PathFIL *fp = parked_files[i].fp;
+        if(fp && fp->path_hash == hash && !strcmp(fp->park_path, path)){
+            parked_files[i].fp = NULL;
+            return fp;
+        }
+    }
+    return NULL;
+}
+
+// a handle for writing got opened, wrote or got closed, parked handles of the same file are stale now
+static void park_invalidate(FIL *fil){
+    for(int i=0; i<PARKED_FILES; i++){
+        PathFIL *fp = parked_files[i].fp;
+        if(fp && fp->fil.obj.fs == fil->obj.fs && fp->fil.dir_sect == fil->dir_sect && fp->fil.dir_ptr == fil->dir_ptr)
+            park_close(parked_files + i);
+    }
+}
+
+// removing or renaming can change what a path refers to
+static void park_flush(FATFS *fs){
+    for(int i=0; i<PARKED_FILES; i++){
+        if(parked_files[i].fp && parked_files[i].fp->fil.obj.fs == fs)
+            park_close(parked_files + i);
+    }
+}
+
+// FatFs and salio are used by the FSFAT worker and the sync timer thread. They take turns
+// through a queue holding one message, the free lock. The worker creates and fills it on its
+// first request, before it creates the thread. The attach path runs on another thread and
+// does not take the lock, it only leaves the new device handle for the worker.
+static int sync_lock_queue = -1;
+static u32 sync_lock_message[1];
+
+static void fatfs_lock(void){
+    u32 msg;
+    if(sync_lock_queue >= 0)
+        iosReceiveMessage(sync_lock_queue, &msg, 0);
+}
+
+static void fatfs_unlock(void){
+    if(sync_lock_queue >= 0)
+        iosSendMessage(sync_lock_queue, 0, 0);
+}
+
+// The device of the volume is gone or got attached again: nothing cached for the volume is
+// valid anymore. Open handles fail FatFs' validation from here on, and the volume has to
+// be mounted again.
+static void fatfs_drop_volume(int drive){
+    FATFS *fs = fatfs_mounts[drive].fs;
+    DPRINTF(3, ("%s: Dropping drive %d\n", MODULE_NAME, drive));
+    if(fs){
+        file_cache_invalidate_volume(fs);
+        park_flush(fs);
+    }
+    salio_invalidate(drive);
+    fatfs_mounts[drive].mounted = false;
+    fatfs_mounts[drive].mount_count = 0;
+}
+
+// runs on the worker and the timer thread with the lock held
+static void fatfs_apply_reattach(void){
+    for(int drive=0; drive<FF_VOLUMES; drive++){
+        if(fatfs_mounts[drive].reattached){
+            fatfs_mounts[drive].reattached = false;
+            salio_set_dev_handle(drive, fatfs_mounts[drive].reattach_handle);
+            fatfs_drop_volume(drive);
+        }
+    }
+}
+
+// called from the attach path, not from the worker
+int salfatfs_add_volume(uint volume_handle, uint dev_handle){
+    int index = salfatfs_find_index(volume_handle);
+    if(index>=0){
+        fatfs_mounts[index].reattach_handle = dev_handle;
+        fatfs_mounts[index].reattached = true;
+        return index;
+    }
+
+    for(index=0; index<FF_VOLUMES; index++){
+        if(!fatfs_mounts[index].used){
+            // the worker only looks at a volume once it is marked used
+            fatfs_mounts[index].volume_handle = volume_handle;
+            fatfs_mounts[index].mounted = false;
+            salio_set_dev_handle(index, dev_handle);
+            fatfs_mounts[index].used = true;
+            return index;
+        }
+    }
+    return -1;
 }
 
 static FATError fatfs_map_error(FRESULT error){
@@ -177,12 +603,23 @@ static FATError fatfs_mount(int drive){
     
     DPRINTF(3, ("%s: Mounting index: %d, path: %s, volume_handle: 0x%08x\n", MODULE_NAME, drive, path, fatfs_mounts[drive].volume_handle));
 
+    // the window only needs to hold one sector of the attached device
+    uint sector_size = salio_get_sector_size(drive);
     if(!fatfs_mounts[drive].fs){
-        fatfs_mounts[drive].fs = ff_allocate_FATFS();
+        fatfs_mounts[drive].fs = ff_allocate_FATFS(sector_size);
         if(!fatfs_mounts[drive].fs)
             return FAT_ERROR_OUT_OF_RESOURCES;
+        fatfs_mounts[drive].win_size = sector_size;
+    } else if(fatfs_mounts[drive].win_size < sector_size){
+        // a device with larger sectors got attached to this slot
+        BYTE *old = fatfs_mounts[drive].fs->win;
+        if(!ff_allocate_sectors(fatfs_mounts[drive].fs, sector_size))
+            return FAT_ERROR_OUT_OF_RESOURCES;
+        free_local(old);
+        fatfs_mounts[drive].win_size = sector_size;
     }
 
+    fatfs_mounts[drive].cluster_shift = 0;
     FRESULT res = f_mount(fatfs_mounts[drive].fs, path, 0);
     DPRINTF(3, ("%s: mount returned %x\n", MODULE_NAME, res));
     if(res == FR_OK){
@@ -200,7 +637,17 @@ static FATError fatfs_unmount(FAT_UnmountRequest *req, int drive) {
     if(fatfs_mounts[drive].mount_count == 0 && fatfs_mounts[drive].mounted){
         TCHAR path[5];
         snprintf(path, sizeof(path), "%d:", drive);
-        FRESULT res = f_mount(0, path, 0);
+        file_cache_invalidate_volume(fatfs_mounts[drive].fs);
+        park_flush(fatfs_mounts[drive].fs);
+        // closed files still waiting in the sync group and the deferred allocation information.
+        // This is their last chance to get to the medium, so a failure fails the unmount and
+        // the volume stays registered for a retry.
+        FRESULT res = f_syncfs(path, 1);
+        if(res != FR_OK){
+            DPRINTF(3, ("%s: Unmount drive %d, sync returned 0x%x\n", MODULE_NAME, drive, res));
+            return fatfs_map_error(res);
+        }
+        res = f_mount(0, path, 0);
         fatfs_mounts[drive].mounted = false;
         return fatfs_map_error(res);
     }
@@ -210,21 +657,8 @@ static FATError fatfs_unmount(FAT_UnmountRequest *req, int drive) {
 static FATError fatfs_make_dir(FAT_MkdirRequest *req, int drive){
     char path_buf[512+4];
     snprintf(path_buf, sizeof(path_buf), "%d:%s", drive, req->path);
-    FRESULT res = f_mkdir(path_buf);
-    if(res == FR_NO_PATH){
-        char *pos = strchr(path_buf, '/'); //skip root
-        while(pos && pos[1]) {
-            pos = strchr(pos + 1, '/');
-            if(pos)
-                *pos = 0;
-            res = f_mkdir(path_buf);
-            DPRINTF(3, ("%s: make_dir %s returned 0x%x\n", MODULE_NAME, path_buf, res));
-            if(pos)
-                *pos = '/';
-            if(res != FR_OK && res != FR_EXIST)
-                break;
-        }
-    }
+    // creates missing parents too, walking the path only once
+    FRESULT res = f_mkpath(path_buf);
     DPRINTF(3, ("%s: make_dir %s returned 0x%x\n", MODULE_NAME, path_buf, res));
     return fatfs_map_error(res);
 }
@@ -234,9 +668,14 @@ static FATError fatfs_open_dir(FAT_OpenDirRequest *req, int drive){
     if(!dp) {
         return FAT_ERROR_OUT_OF_RESOURCES;
     }
-    snprintf(dp->path, sizeof(dp->path), "%d:%s", drive, req->path);
+    TCHAR path_buf[512+4];
+    snprintf(path_buf, sizeof(path_buf), "%d:%s", drive, req->path);
+#ifdef FATFS_DEBUG
+    strcpy(dp->path, path_buf);
+#endif
 
-    FRESULT res = f_opendir(&dp->dir, dp->path);
+    dp->pending = FR_OK;
+    FRESULT res = f_opendir(&dp->dir, path_buf);
     DPRINTF(3, ("%s: open_dir %p, %s, returned 0x%x\n", MODULE_NAME, dp, dp->path, res));
     if(res != FR_OK){
         ff_free_DIR(dp);
@@ -246,6 +685,39 @@ static FATError fatfs_open_dir(FAT_OpenDirRequest *req, int drive){
     return fatfs_map_error(res);
 }
 
+// days before the 1st of each month, second row for leap years
+static const uint16_t fat_days_before_month[2][12] = {
+    { 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334 },
+    { 0, 31, 60, 91, 121, 152, 182, 213, 244, 274, 305, 335 },
+};
+
+// FAT date/time to microseconds since 1980-01-01, no libc timezone handling and no divisions
+static FSTime fat_time_to_fstime(WORD fdate, WORD ftime){
+    uint year = fdate >> 9; // years since 1980, up to 2107
+    uint mon = (fdate >> 5 & 15) - 1;
+    uint mday = fdate & 31;
+    if(mon > 11)
+        mon = 0;
+    if(mday)
+        mday--;
+
+    // every 4th year is a leap year in the FAT range, except 2100
+    bool leap = (year & 3) == 0 && year != 120;
+    uint days = year * 365 + ((year + 3) >> 2) - (year > 120);
+    days += fat_days_before_month[leap][mon] + mday;
+
+    uint secs = (ftime >> 11) * 3600 + (ftime >> 5 & 63) * 60 + (ftime & 31) * 2;
+    return ((uint64_t)days * 86400 + secs) * 1000000ULL;
+}
+
+static uint fatfs_cluster_shift(int drive){
+    if(!fatfs_mounts[drive].cluster_shift){
+        FATFS *fs = fatfs_mounts[drive].fs;
+        fatfs_mounts[drive].cluster_shift = __builtin_ctz(fs->csize * fs->ssize);
+    }
+    return fatfs_mounts[drive].cluster_shift;
+}
+
 static void convert_filinfo_to_fsstat(FILINFO *info, FSStat *stat, int drive){
     FSStatFlags flags = 0x0c000000;
     if(info->fattrib & AM_DIR){
@@ -257,40 +729,62 @@ static void convert_filinfo_to_fsstat(FILINFO *info, FSStat *stat, int drive){
     stat->mode = (info->fattrib & AM_RDO) ? 0x444:0x666;
     stat->size = info->fsize;
 
-    FATFS *fs = fatfs_mounts[drive].fs;
-    uint32_t cs = fs->csize * fs->ssize;
-    uint32_t slack = cs - info->fsize % cs;
-    stat->allocSize = info->fsize + slack;
-
-    struct tm tinfo = {
-        .tm_year = (info->fdate >> 9) + 70,
-        .tm_mon = (info->fdate >> 5 & 15) - 1,
-        .tm_mday = info->fdate & 31,
-        .tm_hour = info->ftime >> 11,
-        .tm_min = info->ftime >> 5 & 63
-    };
-    time_t ts = mktime(&tinfo);
-    DPRINTF(3,("Stat time: %d-%d-%d %d:%d\n", tinfo.tm_year, tinfo.tm_mon + 1, tinfo.tm_mday, tinfo.tm_hour, tinfo.tm_min));
-    stat->modified = ts * 1000000UL;
-    
+    FSIZE_t cs_mask = ((FSIZE_t)1 << fatfs_cluster_shift(drive)) - 1;
+    stat->allocSize = (info->fsize + cs_mask) & ~cs_mask;
+
+    DPRINTF(3,("Stat time: %d-%d-%d %d:%d\n", (info->fdate >> 9) + 1980, info->fdate >> 5 & 15, info->fdate & 31, info->ftime >> 11, info->ftime >> 5 & 63));
+    stat->modified = fat_time_to_fstime(info->fdate, info->ftime);
+}
+
+static FRESULT fatfs_read_dir_entry(PathDIR *dp, FSDirectoryEntry *entry, FILINFO *info, int drive){
+    FRESULT res = dp->pending;
+    if(res != FR_OK){
+        dp->pending = FR_OK;
+        return res;
+    }
+    res = f_readdir(&dp->dir, info);
+    if(res == FR_OK && info->fname[0]){
+        strncpy(entry->name, info->fname, sizeof(entry->name));
+        convert_filinfo_to_fsstat(info, &entry->info, drive);
+    }
+    return res;
 }
 
 static FATError fatfs_read_dir(FAT_ReadDirRequest *req, int drive){
     PathDIR *dp = *req->dp;
     FILINFO info;
-    FRESULT res = f_readdir(&dp->dir, &info);
+    FRESULT res = fatfs_read_dir_entry(dp, req->entry, &info, drive);
     DPRINTF(3, ("%s: read_dir %p, %s, returned 0x%x\n", MODULE_NAME, dp, dp->path, res));
-    if(res == FR_OK){
-        if(info.fname[0] == 0){
-            DPRINTF(3, ("FAT_ERROR_END_OF_DIR\n"));
-            return FAT_ERROR_END_OF_DIR;
-        }
-        strncpy(req->entry->name, info.fname, sizeof(req->entry->name));
-        convert_filinfo_to_fsstat(&info, &req->entry->info, drive);
+    if(res == FR_OK && info.fname[0] == 0){
+        DPRINTF(3, ("FAT_ERROR_END_OF_DIR\n"));
+        return FAT_ERROR_END_OF_DIR;
     }
     return fatfs_map_error(res);
 }
 
+static FATError fatfs_read_dir_multi(FAT_ReadDirMultiRequest *req, int drive){
+    PathDIR *dp = *req->dp;
+    FILINFO info;
+    FRESULT res = FR_OK;
+    uint n = 0;
+    while(n < req->count){
+        res = fatfs_read_dir_entry(dp, req->entries + n, &info, drive);
+        if(res != FR_OK || info.fname[0] == 0)
+            break;
+        n++;
+    }
+    DPRINTF(3, ("%s: read_dir_multi %p, %s, %u/%u entries, returned 0x%x\n", MODULE_NAME, dp, dp->path, n, req->count, res));
+    // report the entries we already have. The directory position may have moved past the
+    // failing entry, so the error is kept for the next call instead of reading it again.
+    if(n){
+        dp->pending = res;
+        return n;
+    }
+    if(res == FR_OK)
+        return FAT_ERROR_END_OF_DIR;
+    return fatfs_map_error(res);
+}
+
 static FATError fatfs_close_dir(FAT_CloseDirRequst *req){
     PathDIR *dp = *req->dp;
     FRESULT res = f_closedir(&dp->dir);
@@ -300,41 +794,110 @@ static FATError fatfs_close_dir(FAT_CloseDirRequst *req){
 
 static FATError fatfs_open_file(FAT_OpenFileRequest *req, int drive){
     BYTE mode = parse_mode_str(req->mode);
-    PathFIL *fp = ff_allocate_FIL();
+    TCHAR path_buf[512+4];
+    snprintf(path_buf, sizeof(path_buf), "%d:%s", drive, req->path);
+    uint64_t hash = 0;
+    if(mode == FA_READ){
+        hash = path_hash(path_buf);
+        PathFIL *fp = park_take(hash, path_buf);
+        if(fp){
+            // rewinding needs no device access
+            FRESULT res = f_lseek(&fp->fil, 0);
+            if(res == FR_OK){
+                DPRINTF(3, ("%s: open_file %p, %s reopened\n", MODULE_NAME, fp, fp->path));
+                fp->cache_check = fp->fil.obj.objsize && fp->fil.obj.objsize <= FILE_CACHE_MAX_FILE;
+                fp->cache_missed = false;
+                *req->filehandle_out_ptr = fp;
+                return FAT_ERROR_OK;
+            }
+            f_close(&fp->fil);
+            ff_free_FIL(fp);
+        }
+    }
+    uint sector_size = salio_get_sector_size(drive);
+    // read/write handles are mostly record stores (saves, databases), a window of several
+    // sectors merges their small records in memory
+    uint buf_size = sector_size;
+    if((mode & FA_READ) && (mode & FA_WRITE) && buf_size < RECORD_BUFFER_SIZE)
+        buf_size = RECORD_BUFFER_SIZE;
+    PathFIL *fp = ff_allocate_FIL(buf_size);
     if(!fp) {
         return FAT_ERROR_OUT_OF_RESOURCES;
     }
-    snprintf(fp->path, sizeof(fp->path), "%d:%s", drive, req->path);
+    // use all of a pooled buffer, it may be larger than needed
+    fp->fil.nbuf = fp->buf_size / sector_size;
+    fp->cache = NULL;
+    fp->path_hash = hash;
+    // without its path the handle is not parked
+    if(hash && !park_set_path(fp, path_buf))
+        fp->path_hash = 0;
+#ifdef FATFS_DEBUG
+    strcpy(fp->path, path_buf);
+#endif
 
-    FRESULT res = f_open(&fp->fil, fp->path, mode);
+    FRESULT res = f_open(&fp->fil, path_buf, mode);
     DPRINTF(3, ("%s: open_file %p, %s, 0x%x returned 0x%x\n", MODULE_NAME, fp, fp->path, mode, res));
     if(res != FR_OK){
         ff_free_FIL(fp);
         fp = NULL;
+    } else {
+        fp->cache_check = mode == FA_READ && f_size(&fp->fil) && f_size(&fp->fil) <= FILE_CACHE_MAX_FILE;
+        fp->cache_missed = false;
+        if(mode & FA_WRITE)
+            park_invalidate(&fp->fil);
     }
     *req->filehandle_out_ptr = fp;
     return fatfs_map_error(res);
 }
 
 static FATError fatfs_seek(FIL* fp, uint pos){
-    FSIZE_t old_pos = f_tell(fp);
+    // check the target against the size up front instead of seeking and
+    // seeking back, only writable handles may grow the file by seeking
+    if(pos > f_size(fp) && !(fp->flag & FA_WRITE))
+        return FAT_ERROR_OUT_OF_RANGE;
+    // sequential positioned I/O lands on the current position
+    if(pos == f_tell(fp))
+        return FAT_ERROR_OK;
+    // f_lseek walks forward from the current cluster
     FRESULT res = f_lseek(fp, pos);
     if(res != FR_OK)
         return fatfs_map_error(res);
-    FSIZE_t curr_pos = f_tell(fp);
-    if(curr_pos != pos){
-        res = f_lseek(fp, old_pos);
-        if(res != FR_OK)
-            return fatfs_map_error(res);
-        return FAT_ERROR_OUT_OF_RANGE;
-    }
+    if(f_tell(fp) != pos)
+        return FAT_ERROR_STORAGE_FULL;
     return FAT_ERROR_OK;
 }
 
+static FATError fatfs_read_cached(PathFIL *fp, FAT_ReadFileRequest *req){
+    file_cache_entry *entry = fp->cache;
+    if(req->flags & READ_REQUEST_WITH_POS){
+        if(req->pos > entry->size)
+            return FAT_ERROR_OUT_OF_RANGE;
+        fp->cache_pos = req->pos;
+    }
+    FSIZE_t n = req->size * req->count;
+    if(n > entry->size - fp->cache_pos)
+        n = entry->size - fp->cache_pos;
+    memcpy(req->buffer, entry->data + fp->cache_pos, n);
+    fp->cache_pos += n;
+    entry->last_use = ++file_cache_clock;
+    file_cache_stats.served += n;
+    return n / req->size;
+}
+
 static FATError fatfs_read_file(FAT_ReadFileRequest *req){
     PathFIL *fp = *(req->file);
     DPRINTF(3, ("%s: ReadFile(%p, %d, %d, %u, %p (%s), 0x%x)\n", MODULE_NAME, req->buffer, req->size, req->count, req->pos,fp, fp->path, req->flags));
 
+    if(fp->cache_check)
+        file_cache_attach(fp, (req->flags & READ_REQUEST_WITH_POS) ? req->pos : f_tell(&fp->fil), (FSIZE_t)req->size * req->count);
+    if(fp->cache){
+        if(fp->cache->valid)
+            return fatfs_read_cached(fp, req);
+        FRESULT res = file_cache_detach(fp);
+        if(res != FR_OK)
+            return fatfs_map_error(res);
+    }
+
     if(req->flags & READ_REQUEST_WITH_POS){
         FATError error = fatfs_seek(&fp->fil, req->pos);
         if(error != FAT_ERROR_OK) {
@@ -355,15 +918,15 @@ static FATError fatfs_read_file(FAT_ReadFileRequest *req){
 static FATError fatfs_write_file(FAT_ReadFileRequest *req){
     PathFIL *fp = *req->file;
     FRESULT res;
-    // TODO optimize: block seek for wo append, then we don't need to seek here for wo append
-    if(fp->fil.flag & FA_OPEN_APPEND) {
-        FILINFO *info;
-        res = f_lseek(&fp->fil, (FSIZE_t)0xFFFFFFFFFFFFFFFF);
-        if(res != FR_OK)
-            return fatfs_map_error(res);
-    }
-
-    if(req->flags & READ_REQUEST_WITH_POS){
+    if((fp->fil.flag & FA_OPEN_APPEND) == FA_OPEN_APPEND) {
+        // writes always go to the end; the position only leaves it when an
+        // a+ handle read or seeked, so the common case needs no seek at all
+        if(f_tell(&fp->fil) != f_size(&fp->fil)) {
+            res = f_lseek(&fp->fil, f_size(&fp->fil));
+            if(res != FR_OK)
+                return fatfs_map_error(res);
+        }
+    } else if(req->flags & READ_REQUEST_WITH_POS){
         FATError error = fatfs_seek(&fp->fil, req->pos);
         if(error != FAT_ERROR_OK)
             return error;
@@ -371,6 +934,9 @@ static FATError fatfs_write_file(FAT_ReadFileRequest *req){
 
     UINT bw;
     res = f_write(&fp->fil, req->buffer, req->size * req->count, &bw);
+    // a new file gets its start cluster on the first write
+    file_cache_invalidate(fp->fil.obj.fs, fp->fil.obj.sclust);
+    park_invalidate(&fp->fil);
     if(res != FR_OK)
         return fatfs_map_error(res);
 
@@ -381,7 +947,8 @@ static FATError fatfs_stat_file(FAT_StatFileRequest *req, int drive) {
     PathFIL* fp = *req->fp;
     FILINFO info;
     DPRINTF(3, ("%s: StatFile(%s)", MODULE_NAME, fp->path));
-    FRESULT res = f_stat(fp->path, &info);
+    // from the open file, no path walk and the size includes unsynced writes
+    FRESULT res = f_fstat(&fp->fil, &info);
     if(res == FR_OK){
         convert_filinfo_to_fsstat(&info, req->stat, drive);
     }
@@ -391,12 +958,44 @@ static FATError fatfs_stat_file(FAT_StatFileRequest *req, int drive) {
 
 static FATError fatfs_setpos_file(FAT_SetPosFileRequest *req){
     PathFIL *fp = *req->file;
-    return fatfs_seek(&fp->fil, req->pos);
+    // write only append handles stay at the end of the file
+    if((fp->fil.flag & (FA_OPEN_APPEND | FA_READ)) == FA_OPEN_APPEND)
+        return FAT_ERROR_UNSUPPORTED_COMMAND;
+    if(fp->cache && fp->cache->valid){
+        if(req->pos > fp->cache->size)
+            return FAT_ERROR_OUT_OF_RANGE;
+        fp->cache_pos = req->pos;
+        return FAT_ERROR_OK;
+    }
+    if(fp->cache){
+        FRESULT res = file_cache_detach(fp);
+        if(res != FR_OK)
+            return fatfs_map_error(res);
+    }
+    FATError error = fatfs_seek(&fp->fil, req->pos);
+    // seeking past the end extends a writable file
+    if(fp->fil.flag & FA_WRITE){
+        file_cache_invalidate(fp->fil.obj.fs, fp->fil.obj.sclust);
+        park_invalidate(&fp->fil);
+    }
+    return error;
 }
 
 static FATError fatfs_close_file(FAT_CloseFileRequest *req){
     PathFIL *fp = *req->file;
     DPRINTF(3, ("%s: CloseFile(%s)\n", MODULE_NAME, fp->path));
+    if(fp->cache){
+        file_cache_release(fp->cache);
+        fp->cache = NULL;
+    }
+    // read only handles have nothing to sync, keep them for a reopen
+    if(fp->path_hash && !(fp->fil.flag & FA_WRITE)){
+        park_put(fp);
+        return FAT_ERROR_OK;
+    }
+    // readers parked while this handle was open saw the directory entry before the sync
+    if(fp->fil.flag & FA_WRITE)
+        park_invalidate(&fp->fil);
     FATError res = f_close(&fp->fil);
     ff_free_FIL(fp);
     return fatfs_map_error(res);
@@ -405,6 +1004,7 @@ static FATError fatfs_close_file(FAT_CloseFileRequest *req){
 static FATError fatfs_remove(FAT_RemoveRequest *req, int drive){
     TCHAR path_buf[512+4];
     snprintf(path_buf, sizeof(path_buf), "%d:%s", drive, req->path);
+    park_flush(fatfs_mounts[drive].fs);
     FRESULT res = f_unlink(path_buf);
     DPRINTF(3, ("%s: Remove(%s) -> 0x%x\n", MODULE_NAME, path_buf, res));
     return fatfs_map_error(res);
@@ -415,6 +1015,7 @@ static FATError fatfs_rename(FAT_RenameRequest *req, int drive){
     snprintf(path_buf, sizeof(path_buf), "%d:%s", drive, req->path);
     TCHAR path2_buf[512+4];
     snprintf(path2_buf, sizeof(path2_buf), "%d:%s", drive, req->new_name);
+    park_flush(fatfs_mounts[drive].fs);
     FRESULT res = f_rename(path_buf, path2_buf);
     DPRINTF(3, ("%s: Rename(%s, %s) -> 0x%x\n", MODULE_NAME, path_buf, path2_buf, res));
     return fatfs_map_error(res);
@@ -497,6 +1098,14 @@ static FATError fatfs_message_dispatch(FAT_WorkMessage *message){
         return -1;
     }
 
+    // a vanished medium fails the requests of the volume until the device is attached again,
+    // unmounting still works
+    if(message->command != 0x03 && !salio_media_ready(drive)){
+        if(fatfs_mounts[drive].mounted)
+            fatfs_drop_volume(drive);
+        return FAT_ERROR_MEDIA_NOT_READY;
+    }
+
     //commands requirering a valid drive
     switch(message->command){
         case 0x02:
@@ -509,6 +1118,8 @@ static FATError fatfs_message_dispatch(FAT_WorkMessage *message){
             return fatfs_open_dir(&message->request.open_dir, drive);
         case 0x07:
             return fatfs_read_dir(&message->request.read_dir, drive);
+        case FAT_COMMAND_READ_DIR_MULTI:
+            return fatfs_read_dir_multi(&message->request.read_dir_multi, drive);
         case 0x0a:
             return fatfs_open_file(&message->request.open_file, drive);
         case 0x10:
@@ -528,10 +1139,77 @@ static FATError fatfs_message_dispatch(FAT_WorkMessage *message){
     return FAT_ERROR_UNSUPPORTED_COMMAND;
 }
 
+// Closes only flush the volume every FF_FS_SYNC_GROUP files. Every request flushes groups
+// that are FF_FS_SYNC_TIME seconds old. When no request follows the last closes of a burst,
+// a timer thread flushes the waiting groups every FF_FS_SYNC_TIME seconds, together with
+// the pages of the salio cache. A closed file is on the medium within FF_FS_SYNC_TIME
+// seconds. If the thread could not be set up, that only holds while requests keep coming
+// in. The thread runs one priority level below the worker that creates it: a flush is never
+// more urgent than a request, and with the lock it can not run inside one anyway.
+#define SYNC_THREAD_STACK_SIZE 0x2000
+
+static int sync_timer_queue = -1;
+static u32 sync_timer_message[1];
+static u32 sync_thread_stack[SYNC_THREAD_STACK_SIZE / sizeof(u32)] ALIGNED(8);
+
+static void fatfs_sync_due(BYTE opt){
+    for(int drive=0; drive<FF_VOLUMES; drive++){
+        if(fatfs_mounts[drive].mounted && fatfs_mounts[drive].fs->nsync){
+            TCHAR path[5];
+            snprintf(path, sizeof(path), "%d:", drive);
+            f_syncfs(path, opt);
+        }
+    }
+}
+
+static u32 fatfs_sync_thread(void *arg){
+    u32 msg;
+    while(iosReceiveMessage(sync_timer_queue, &msg, 0) >= 0){
+        fatfs_lock();
+        fatfs_apply_reattach();
+        salio_expire_time();
+        fatfs_sync_due(1);
+        fatfs_unlock();
+    }
+    return 0;
+}
+
+// runs on the first request, the thread has to belong to the FS process. The lock is ready
+// before the thread exists, so nothing ever runs without it once there is a second thread.
+static void fatfs_sync_thread_init(void){
+    static bool done;
+    if(done)
+        return;
+    done = true;
+    int lock = iosCreateMessageQueue(sync_lock_message, 1);
+    // the message in the queue is the free lock
+    if(lock < 0 || iosSendMessage(lock, 0, 0) < 0)
+        return;
+    sync_lock_queue = lock;
+    sync_timer_queue = iosCreateMessageQueue(sync_timer_message, 1);
+    if(sync_timer_queue < 0)
+        return;
+    int priority = iosGetThreadPriority(0);
+    if(priority < 1)
+        return;
+    int thread = iosCreateThread(fatfs_sync_thread, NULL, sync_thread_stack + sizeof(sync_thread_stack) / sizeof(u32),
+            SYNC_THREAD_STACK_SIZE, priority - 1, 0);
+    if(thread < 0)
+        return;
+    if(iosCreateTimer(FF_FS_SYNC_TIME * 1000000, FF_FS_SYNC_TIME * 1000000, sync_timer_queue, 0) < 0 || iosStartThread(thread) < 0)
+        debug_printf("%s: no sync timer, groups wait for the next request\n", MODULE_NAME);
+}
+
 void salfatfs_process_message(FAT_WorkMessage *message){
     DPRINTF(3, ("%s: Command: %02X\n", MODULE_NAME, message->command));
+    fatfs_sync_thread_init();
+    fatfs_lock();
+    fatfs_apply_reattach();
+    salio_expire_time();
     int ret = fatfs_message_dispatch(message);
     DPRINTF(3, ("%s: Command: 0x%02X returned 0x%x\n", MODULE_NAME, message->command, ret));
     if(message->callback)
         message->callback(ret, message->calback_data);
+    fatfs_sync_due(0);
+    fatfs_unlock();
 }
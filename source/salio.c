@@ -36,46 +36,135 @@ FSSALDevice* (*FSSAL_LookupDevice)(FSSALHandle device) = (void*)0x10733990;
 typedef struct salio_device {
     uint32_t device_handle;
     uint32_t sector_size;
+    LBA_t block_count;
+    uint page_sectors; // sectors per cache page, 0 if the sectors are larger than a page
+    UINT max_blocks;   // sectors per transfer, a power of two, 0 for no limit
+    uint buf_align;    // buffers the device can transfer to directly
+    bool present;      // device attached and its medium ready, as of the last disk_status
     bool sync_unsupported;
     int semaphore;   
 } salio_device;
 
 static salio_device devices[FF_VOLUMES] = { };
 
+// alignment of the buffers of salio, bounds what a device may ask for
+#define SALIO_BOUNCE_ALIGNMENT 64
+
+// Page cache below FatFs, shared by the volumes. Small reads fill a whole page, so sector
+// sized loads of the volume window and the file buffers of all handles find their data
+// here. Small writes to cached pages stay in the page until the next CTRL_SYNC or until
+// the page gets evicted. Large transfers go to the device directly and keep the cached
+// pages coherent.
+#define SALIO_PAGE_SIZE 0x1000
+#define SALIO_PAGES 16
+
+typedef struct salio_page {
+    BYTE pdrv;
+    UINT count;       // sectors held, 0 for a free page
+    LBA_t lba;        // first sector, aligned to the page size
+    uint32_t dirty;   // sectors to write back
+    uint last_use;
+} salio_page;
+
+static salio_page pages[SALIO_PAGES];
+static BYTE page_data[SALIO_PAGES][SALIO_PAGE_SIZE] ALIGNED(SALIO_BOUNCE_ALIGNMENT);
+static uint page_clock;
+
 void salio_set_dev_handle(int index, uint dev_handle){
     salio_device *dev = devices + index;
     dev->device_handle = dev_handle;
     FSSALDevice* sal_device = FSSAL_LookupDevice(dev_handle);
     dev->sector_size = sal_device->block_size;
+    dev->block_count = (LBA_t)sal_device->block_count_hi << 32 | sal_device->block_count;
+    dev->page_sectors = SALIO_PAGE_SIZE / dev->sector_size;
+    // Transfers get split at multiples of the largest power of two the device takes at once.
+    // A limit beyond the size of the device is no limit.
+    dev->max_blocks = 0;
+    if(!sal_device->max_lba_size_hi && sal_device->max_lba_size && sal_device->max_lba_size < dev->block_count)
+        dev->max_blocks = 1u << (31 - __builtin_clz(sal_device->max_lba_size));
+    uint align = sal_device->alignment_smth;
+    dev->buf_align = SALIO_ALIGNMENT;
+    if(align > SALIO_ALIGNMENT && align <= SALIO_BOUNCE_ALIGNMENT && !(align & (align - 1)))
+        dev->buf_align = align;
+    DPRINTF(3, ("%s: drive %d: sector size %u, max transfer %u sectors, alignment %u\n", MODULE_NAME, index, dev->sector_size, dev->max_blocks, dev->buf_align));
+    dev->present = sal_device->media_state == FS_MEDIA_STATE_READY;
     dev->sync_unsupported = false;
+    // whatever was cached belongs to the previous device
+    salio_invalidate(index);
 }
 
-DSTATUS disk_initialize (BYTE pdrv){
-    return 0;
+void salio_invalidate(int index){
+    for(int i=0; i<SALIO_PAGES; i++){
+        if(pages[i].pdrv == index)
+            pages[i].count = 0;
+    }
+}
+
+uint salio_get_sector_size(int index){
+    return devices[index].sector_size;
 }
 
+// FatFs asks before every access to a mounted volume. A detached device or a medium that is
+// not ready makes the access fail with FR_NOT_READY, and reads and writes fail with
+// RES_NOTRDY without going to the device until the next disk_status finds it ready again.
 DSTATUS disk_status (BYTE pdrv) {
-    return 0; // TODO
+    salio_device *dev = devices + pdrv;
+    FSSALDevice* sal_device = FSSAL_LookupDevice(dev->device_handle);
+    bool present = sal_device && sal_device->media_state == FS_MEDIA_STATE_READY;
+    if(present != dev->present)
+        DPRINTF(3, ("%s: drive %d %s (media_state %d)\n", MODULE_NAME, pdrv, present?"ready":"gone", sal_device?(int)sal_device->media_state:-1));
+    dev->present = present;
+    return present ? 0 : STA_NOINIT;
+}
+
+DSTATUS disk_initialize (BYTE pdrv){
+    return disk_status(pdrv);
 }
 
-static BYTE aligned_buffer[512 * 128] ALIGNED(SALIO_ALIGNMENT);
+bool salio_media_ready(int index){
+    return !(disk_status(index) & STA_NOINIT);
+}
 
-DRESULT disk_read (BYTE pdrv, BYTE* buff, LBA_t sector, UINT count) {
+static BYTE aligned_buffer[512 * 128] ALIGNED(SALIO_BOUNCE_ALIGNMENT);
+
+// sectors of the next transfer, ending on a multiple of limit (a power of two, 0 for none) so
+// that the transfers following it are aligned to the limit
+static UINT transfer_sectors(LBA_t sector, UINT count, UINT limit){
+    if(limit)
+        count = min(count, limit - ((UINT)sector & (limit - 1)));
+    return count;
+}
+
+// transfers to or from the bounce buffer are bound by its size as well
+static UINT bounce_limit(salio_device *dev){
+    UINT buffer_sectors = sizeof(aligned_buffer) / dev->sector_size;
+    return dev->max_blocks && dev->max_blocks < buffer_sectors ? dev->max_blocks : buffer_sectors;
+}
+
+static DRESULT raw_read(BYTE pdrv, BYTE* buff, LBA_t sector, UINT count) {
     salio_device *dev = devices + pdrv;
     int res;
-    if((uint)buff % SALIO_ALIGNMENT == 0){
-        res = FSSAL_RawRead(dev->device_handle, sector>>32,sector, count, buff, NULL, NULL);
-        DPRINTF(3, ("%s: disk_read(%d, %p, %d, %d) -> 0x%x\n", MODULE_NAME, pdrv, buff, (uint)sector, count, res));
-        return res?RES_ERROR:RES_OK;
+    if((uint)buff % dev->buf_align == 0){
+        while(count){
+            UINT to_rw = transfer_sectors(sector, count, dev->max_blocks);
+            res = FSSAL_RawRead(dev->device_handle, sector>>32,sector, to_rw, buff, NULL, NULL);
+            DPRINTF(3, ("%s: disk_read(%d, %p, %d, %d) -> 0x%x\n", MODULE_NAME, pdrv, buff, (uint)sector, to_rw, res));
+            if(res)
+                return RES_ERROR;
+            buff += to_rw * dev->sector_size;
+            sector += to_rw;
+            count -= to_rw;
+        }
+        return RES_OK;
     }
 
     DPRINTF(3, ("%s: unaligned disk_read(%d, %p, %d, %d)\n", MODULE_NAME, pdrv, buff, (uint)sector, count));
 
     u32 sector_size = dev->sector_size;
-    int buffer_sectors = sizeof(aligned_buffer) / sector_size;
+    UINT limit = bounce_limit(dev);
 
     while(count){
-        UINT to_rw = min(count, buffer_sectors);
+        UINT to_rw = transfer_sectors(sector, count, limit);
         res = FSSAL_RawRead(dev->device_handle, sector>>32,sector, to_rw, aligned_buffer, NULL, NULL);
         if(res) {
             DPRINTF(3, ("%s: unaligned disk_read(%d, %p, %d, %d) -> failed 0x%x\n", MODULE_NAME, pdrv, buff, (uint)sector, count, res));
@@ -89,22 +178,30 @@ DRESULT disk_read (BYTE pdrv, BYTE* buff, LBA_t sector, UINT count) {
     return RES_OK;
 }
 
-DRESULT disk_write (BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count) {
+static DRESULT raw_write(BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count) {
     salio_device *dev = devices + pdrv;
     int res;
-    if((uint)buff % SALIO_ALIGNMENT == 0){
-        res = FSSAL_RawWrite(dev->device_handle, sector>>32,sector, count, buff, NULL, NULL);
-        DPRINTF(3, ("%s: disk_write(%d, %p, %d, %d) -> 0x%x\n", MODULE_NAME, pdrv, buff, (uint)sector, count, res));
-        return res?RES_ERROR:RES_OK;
+    if((uint)buff % dev->buf_align == 0){
+        while(count){
+            UINT to_rw = transfer_sectors(sector, count, dev->max_blocks);
+            res = FSSAL_RawWrite(dev->device_handle, sector>>32,sector, to_rw, buff, NULL, NULL);
+            DPRINTF(3, ("%s: disk_write(%d, %p, %d, %d) -> 0x%x\n", MODULE_NAME, pdrv, buff, (uint)sector, to_rw, res));
+            if(res)
+                return RES_ERROR;
+            buff += to_rw * dev->sector_size;
+            sector += to_rw;
+            count -= to_rw;
+        }
+        return RES_OK;
     }
 
     DPRINTF(3, ("%s: unaligned disk_write(%d, %p, %d, %d)\n", MODULE_NAME, pdrv, buff, (uint)sector, count));
 
     u32 sector_size = dev->sector_size;
-    UINT buffer_sectors = sizeof(aligned_buffer) / sector_size;
+    UINT limit = bounce_limit(dev);
 
     while(count){
-        UINT to_rw = min(count, buffer_sectors);
+        UINT to_rw = transfer_sectors(sector, count, limit);
         FS_memcpy(aligned_buffer, buff, to_rw * sector_size);
         res = FSSAL_RawWrite(dev->device_handle, sector>>32,sector, to_rw, aligned_buffer, NULL, NULL);
         if(res){
@@ -118,12 +215,234 @@ DRESULT disk_write (BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count) {
     return RES_OK;
 }
 
+static uint32_t sector_mask(UINT first, UINT n){
+    return (n < 32 ? (1u << n) - 1 : ~0u) << first;
+}
+
+static DRESULT page_writeback(salio_page *pg){
+    UINT sector_size = devices[pg->pdrv].sector_size;
+    BYTE *data = page_data[pg - pages];
+    while(pg->dirty){
+        // one write per run of dirty sectors
+        UINT first = __builtin_ctz(pg->dirty);
+        UINT n = __builtin_ctz(~(pg->dirty >> first));
+        if(raw_write(pg->pdrv, data + first * sector_size, pg->lba + first, n) != RES_OK)
+            return RES_ERROR;
+        pg->dirty &= ~sector_mask(first, n);
+    }
+    return RES_OK;
+}
+
+static salio_page* page_find(BYTE pdrv, LBA_t lba){
+    for(int i=0; i<SALIO_PAGES; i++){
+        salio_page *pg = pages + i;
+        if(pg->count && pg->pdrv == pdrv && pg->lba == lba){
+            pg->last_use = ++page_clock;
+            return pg;
+        }
+    }
+    return NULL;
+}
+
+// returns the cached page starting at lba, reading it on a miss
+static salio_page* page_get(BYTE pdrv, LBA_t lba, DRESULT *res){
+    salio_page *pg = page_find(pdrv, lba);
+    if(pg)
+        return pg;
+
+    salio_device *dev = devices + pdrv;
+    if(lba >= dev->block_count){
+        *res = RES_PARERR;
+        return NULL;
+    }
+    pg = pages;
+    for(int i=1; i<SALIO_PAGES && pg->count; i++){
+        if(!pages[i].count || pages[i].last_use < pg->last_use)
+            pg = pages + i;
+    }
+    *res = page_writeback(pg);
+    if(*res != RES_OK)
+        return NULL;
+    pg->count = 0;
+    // the last page of the device may be short
+    UINT count = dev->page_sectors;
+    if(count > dev->block_count - lba)
+        count = dev->block_count - lba;
+    *res = raw_read(pdrv, page_data[pg - pages], lba, count);
+    if(*res != RES_OK)
+        return NULL;
+    pg->pdrv = pdrv;
+    pg->lba = lba;
+    pg->count = count;
+    pg->last_use = ++page_clock;
+    return pg;
+}
+
+// copies the cached sectors of [sector, sector + count) to or from buff, dirty sectors only
+// when reading since the clean ones match the device
+static void page_sync_range(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count, bool to_cache){
+    UINT sector_size = devices[pdrv].sector_size;
+    for(int i=0; i<SALIO_PAGES; i++){
+        salio_page *pg = pages + i;
+        if(!pg->count || pg->pdrv != pdrv || pg->lba >= sector + count || pg->lba + pg->count <= sector)
+            continue;
+        LBA_t first = pg->lba > sector ? pg->lba : sector;
+        LBA_t end = pg->lba + pg->count < sector + count ? pg->lba + pg->count : sector + count;
+        for(LBA_t s = first; s < end; s++){
+            BYTE *data = page_data[i] + (UINT)(s - pg->lba) * sector_size;
+            uint32_t bit = 1u << (UINT)(s - pg->lba);
+            if(to_cache){
+                FS_memcpy(data, buff + (UINT)(s - sector) * sector_size, sector_size);
+                pg->dirty &= ~bit;
+            } else if(pg->dirty & bit){
+                FS_memcpy(buff + (UINT)(s - sector) * sector_size, data, sector_size);
+            }
+        }
+    }
+}
+
+// Writes the dirty pages of the drive back in LBA order. Dirty sectors that run on from the
+// end of one page into the next one are gathered in the bounce buffer and written at once,
+// like the sectors of consecutive directory or FAT updates.
+static DRESULT flush_pages(BYTE pdrv){
+    salio_device *dev = devices + pdrv;
+    UINT sector_size = dev->sector_size;
+    UINT limit = bounce_limit(dev);
+    for(;;){
+        salio_page *pg = NULL;
+        for(int i=0; i<SALIO_PAGES; i++){
+            salio_page *p = pages + i;
+            if(p->count && p->pdrv == pdrv && p->dirty && (!pg || p->lba < pg->lba))
+                pg = p;
+        }
+        if(!pg)
+            return RES_OK;
+
+        UINT first = __builtin_ctz(pg->dirty);
+        salio_page *next = page_find(pdrv, pg->lba + pg->count);
+        // merging needs the run of the first page to fit into one transfer
+        if(pg->dirty != sector_mask(first, pg->count - first) || pg->count - first > limit || !next || !(next->dirty & 1)){
+            if(page_writeback(pg) != RES_OK)
+                return RES_ERROR;
+            continue;
+        }
+
+        salio_page *merged[SALIO_PAGES];
+        uint32_t masks[SALIO_PAGES];
+        UINT npages = 0, n = 0;
+        LBA_t lba = pg->lba + first;
+        uint32_t mask = pg->dirty;
+        UINT ofs = first, run = pg->count - first;
+        while(n + run <= limit){
+            FS_memcpy(aligned_buffer + n * sector_size, page_data[pg - pages] + ofs * sector_size, run * sector_size);
+            merged[npages] = pg;
+            masks[npages++] = mask;
+            n += run;
+            // the run goes on if it filled the page up to its end
+            if(ofs + run < pg->count)
+                break;
+            pg = page_find(pdrv, pg->lba + pg->count);
+            if(!pg || !(pg->dirty & 1))
+                break;
+            ofs = 0;
+            run = __builtin_ctz(~pg->dirty);
+            mask = sector_mask(0, run);
+        }
+        if(raw_write(pdrv, aligned_buffer, lba, n) != RES_OK)
+            return RES_ERROR;
+        for(UINT i=0; i<npages; i++)
+            merged[i]->dirty &= ~masks[i];
+    }
+}
+
+DRESULT disk_read (BYTE pdrv, BYTE* buff, LBA_t sector, UINT count) {
+    salio_device *dev = devices + pdrv;
+    if(!dev->present)
+        return RES_NOTRDY;
+    if(!dev->page_sectors || count > dev->page_sectors){
+        DRESULT res = raw_read(pdrv, buff, sector, count);
+        if(res == RES_OK)
+            page_sync_range(pdrv, buff, sector, count, false);
+        return res;
+    }
+
+    UINT sector_size = dev->sector_size;
+    while(count){
+        LBA_t lba = sector & ~(LBA_t)(dev->page_sectors - 1);
+        DRESULT res;
+        salio_page *pg = page_get(pdrv, lba, &res);
+        if(!pg)
+            return res;
+        UINT ofs = sector - lba;
+        if(ofs >= pg->count)
+            return RES_PARERR;
+        UINT n = min(count, pg->count - ofs);
+        FS_memcpy(buff, page_data[pg - pages] + ofs * sector_size, n * sector_size);
+        buff += n * sector_size;
+        sector += n;
+        count -= n;
+    }
+    return RES_OK;
+}
+
+DRESULT disk_write (BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count) {
+    salio_device *dev = devices + pdrv;
+    if(!dev->present)
+        return RES_NOTRDY;
+    if(!dev->page_sectors || count > dev->page_sectors){
+        DRESULT res = raw_write(pdrv, buff, sector, count);
+        if(res == RES_OK)
+            page_sync_range(pdrv, (BYTE*)buff, sector, count, true);
+        return res;
+    }
+
+    UINT sector_size = dev->sector_size;
+    // sectors not cached, written with one transfer after the loop or before the next cached part
+    const BYTE *uncached = buff;
+    LBA_t uncached_sector = sector;
+    UINT uncached_count = 0;
+    while(count){
+        LBA_t lba = sector & ~(LBA_t)(dev->page_sectors - 1);
+        UINT ofs = sector - lba;
+        UINT n = min(count, dev->page_sectors - ofs);
+        salio_page *pg = page_find(pdrv, lba);
+        if(pg && ofs + n <= pg->count){
+            if(uncached_count){
+                DRESULT res = raw_write(pdrv, uncached, uncached_sector, uncached_count);
+                if(res != RES_OK)
+                    return res;
+                uncached_count = 0;
+            }
+            // written back on the next sync
+            FS_memcpy(page_data[pg - pages] + ofs * sector_size, buff, n * sector_size);
+            pg->dirty |= sector_mask(ofs, n);
+        } else {
+            // not cached, no reason to read the page
+            if(!uncached_count){
+                uncached = buff;
+                uncached_sector = sector;
+            }
+            uncached_count += n;
+        }
+        buff += n * sector_size;
+        sector += n;
+        count -= n;
+    }
+    if(uncached_count)
+        return raw_write(pdrv, uncached, uncached_sector, uncached_count);
+    return RES_OK;
+}
+
 DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff){
     DPRINTF(3, ("%s: disk_ioctl(%i, %i, %p)\n", MODULE_NAME, pdrv, cmd, buff));
     salio_device *dev = devices + pdrv;
     switch (cmd)
     {
         case CTRL_SYNC:
+            if(!dev->present)
+                return RES_NOTRDY;
+            if(flush_pages(pdrv) != RES_OK)
+                return RES_ERROR;
             if(dev->sync_unsupported)
                 return RES_OK;
             int res = FSSAL_Sync(dev->device_handle, 0, 0, 0, NULL, NULL);
@@ -152,9 +471,25 @@ DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff){
     return RES_PARERR;
 }
 
+// FAT timestamps have a resolution of 2 seconds, a request never takes that long. So the
+// clock is read once per request, not for every directory entry a request touches.
+static DWORD fattime;
+static bool fattime_valid;
+static uint fattime_calls, fattime_reads;
+
+void salio_expire_time(void){
+    fattime_valid = false;
+}
+
 DWORD get_fattime (void) {
-    uint16_t date, time;
-    FAT_GetDateTime(&date, &time, NULL);
-    DPRINTF(3, ("%s: get_fattime date: 0x%04X, time: 0x%04X \n", MODULE_NAME, date, time));
-    return (DWORD)date<<16 | time;
+    fattime_calls++;
+    if(!fattime_valid){
+        uint16_t date, time;
+        FAT_GetDateTime(&date, &time, NULL);
+        fattime = (DWORD)date<<16 | time;
+        fattime_valid = true;
+        fattime_reads++;
+        DPRINTF(3, ("%s: get_fattime date: 0x%04X, time: 0x%04X, %u clock reads for %u calls\n", MODULE_NAME, date, time, fattime_reads, fattime_calls));
+    }
+    return fattime;
 }
@@ -1,6 +1,11 @@
 #include "fs_request.h"
 #include "fatfs/ff.h"
+#include <stdbool.h>
 
 #define SALIO_ALIGNMENT 32
 
-void salio_set_dev_handle(int index, uint dev_handle);
\ No newline at end of file
+void salio_set_dev_handle(int index, uint dev_handle);
+void salio_invalidate(int index);
+bool salio_media_ready(int index);
+uint salio_get_sector_size(int index);
+void salio_expire_time(void);
\ No newline at end of file